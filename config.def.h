@@ -8,6 +8,57 @@
 static char font[] = "Monospace:pixelsize=14:antialias=true:hinting=true:hintstyle=hintfull";
 static int borderpx = 2;
 
+/*
+ * 1: render box-drawing (U+2500 - U+257F) and block element
+ *    (U+2580 - U+259F) characters procedurally instead of using the font.
+ *    They are sized to the cell, so lines and blocks join up seamlessly.
+ * 0: use the font for these characters.
+ */
+static int boxdraw = 1;
+/* 1: also render braille (U+2800 - U+28FF) as dots; requires boxdraw */
+static int boxdraw_braille = 1;
+
+/*
+ * 1: keep the fonts matched for each font and size, and the glyphs rasterized
+ *    for them, in $XDG_CACHE_HOME/wterm so that later starts skip fontconfig
+ *    and FreeType. Remove the directory after changing the fontconfig setup.
+ * 0: match and rasterize the fonts on every start.
+ */
+static int fontcache = 0;
+
+/*
+ * 1: derive the bold and italic fonts from the regular one by emboldening
+ *    and slanting its glyphs, sharing its face instead of opening three more.
+ * 0: use the bold and italic faces fontconfig finds, deriving only the
+ *    styles it has no face for.
+ */
+static int synthstyles = 0;
+
+/*
+ * 1: draw into 16-bit RGB565 buffers when the compositor supports them,
+ *    halving the memory and bandwidth they take at the cost of color depth.
+ *    The window is then opaque whatever term_alpha is.
+ * 0: 32-bit buffers.
+ */
+static int rgb565 = 0;
+
+/*
+ * 1: draw with the GPU through wl_drm when the compositor offers it, which
+ *    takes two more roundtrips at startup.
+ * 0: always draw into shared memory with pixman.
+ */
+static int usedrm = 1;
+
+/*
+ * Characters rasterized for all four styles while idle after the fonts are
+ * loaded, so that they are ready when first drawn. Add ranges of characters
+ * you use often, e.g. {0x0370, 0x03ff} for Greek.
+ */
+static Rune prewarmranges[][2] = {
+  {0x0020, 0x007e}, /* ASCII */
+  {0x00a0, 0x00ff}, /* Latin-1 */
+};
+
 /*
  * terminal transparency
  */
@@ -56,6 +107,12 @@ static int allowaltscreen = 1;
  */
 static unsigned int blinktimeout = 800;
 
+/*
+ * how long the window size has to stay the same before the programs in the
+ * terminal are told of it (in milliseconds)
+ */
+static unsigned int ttyresizedelay = 100;
+
 /*
  * thickness of underline and bar cursors
  */
@@ -28,6 +28,8 @@
 #include <stdint.h>
 
 struct wl_display;
+struct wl_registry;
+struct wl_shm;
 struct wl_surface;
 
 #define WLD_WAYLAND_ID (0x3 << 24)
@@ -68,6 +70,32 @@ enum wld_wayland_object_type
 struct wld_context * wld_wayland_create_context
     (struct wl_display * display, enum wld_wayland_interface_id id, ...);
 
+/**
+ * Create a new WLD context using a wl_shm the application has already bound,
+ * without the roundtrips wld_wayland_create_context needs to find the globals
+ * and the supported formats itself.
+ *
+ * The formats are collected as the application dispatches the events of the
+ * wl_shm, so it must not set a listener of its own on it. Until they arrive,
+ * only the formats every compositor supports are reported by
+ * wld_wayland_has_format.
+ */
+struct wld_context * wld_wayland_create_shm_context(struct wl_display * display,
+                                                    struct wl_shm * shm);
+
+/**
+ * Create a new WLD context for the wl_drm global with the given name and
+ * version, which the application found in its registry. This saves the
+ * roundtrip wld_wayland_create_context needs to find the global, but still
+ * waits for the device and for the authentication.
+ *
+ * Returns NULL if the wl_drm cannot be used, for instance with a version
+ * older than 2 or without a driver for its device.
+ */
+struct wld_context * wld_wayland_create_drm_context
+    (struct wl_display * display, struct wl_registry * registry,
+     uint32_t name, uint32_t version);
+
 struct wld_surface * wld_wayland_create_surface(struct wld_context * context,
                                                 uint32_t width, uint32_t height,
                                                 uint32_t format, uint32_t flags,
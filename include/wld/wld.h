@@ -45,7 +45,8 @@
 enum wld_format
 {
     WLD_FORMAT_XRGB8888 = __WLD_FOURCC('X', 'R', '2', '4'),
-    WLD_FORMAT_ARGB8888 = __WLD_FOURCC('A', 'R', '2', '4')
+    WLD_FORMAT_ARGB8888 = __WLD_FOURCC('A', 'R', '2', '4'),
+    WLD_FORMAT_RGB565   = __WLD_FOURCC('R', 'G', '1', '6')
 };
 
 enum wld_flags
@@ -105,10 +106,18 @@ struct wld_font
     uint32_t max_advance;
 };
 
+enum wld_font_style
+{
+    WLD_FONT_BOLD   = 1<<0,
+    WLD_FONT_ITALIC = 1<<1,
+};
+
 /**
  * Create a new font context.
  *
- * This sets up the underlying FreeType library.
+ * This sets up the underlying FreeType library. Fonts of the context may be
+ * opened and closed on any thread, but each font may only be used by one
+ * thread at a time.
  */
 struct wld_font_context * wld_font_create_context();
 
@@ -129,6 +138,15 @@ struct wld_font * wld_font_open_pattern(struct wld_font_context * context,
 struct wld_font * wld_font_open_name(struct wld_font_context * context,
                                      const char * name);
 
+/**
+ * Open a font drawing the glyphs of another one with the given styles
+ * (wld_font_style) applied synthetically: bold by emboldening the outlines and
+ * italic by shearing them. The new font shares the FreeType face of the other
+ * one, which may be closed first.
+ */
+struct wld_font * wld_font_open_synthetic(struct wld_font * font,
+                                          uint32_t styles);
+
 /**
  * Close a font.
  */
@@ -140,6 +158,36 @@ void wld_font_close(struct wld_font * font);
  */
 bool wld_font_ensure_char(struct wld_font * font, uint32_t character);
 
+struct wld_font_stats
+{
+    /* Characters drawn or checked with their glyph already loaded, or not. */
+    uint32_t hits, misses;
+
+    /* The number of glyphs loaded, and the memory they and the tables use. */
+    uint32_t glyphs;
+    size_t memory;
+
+    /* The size of the glyph cache file mapped, if any. */
+    size_t mapped;
+};
+
+/**
+ * Get statistics on the glyphs of a font, for sizing its caches.
+ */
+void wld_font_get_stats(struct wld_font * font, struct wld_font_stats * stats);
+
+/**
+ * Load the glyphs stored in a glyph cache file, mapping it until the font is
+ * closed. The file is only used if it was written for the same font file,
+ * modification time, pixel size and render flags.
+ */
+bool wld_font_read_glyph_cache(struct wld_font * font, const char * path);
+
+/**
+ * Write the glyphs loaded so far to a glyph cache file.
+ */
+bool wld_font_write_glyph_cache(struct wld_font * font, const char * path);
+
 /**
  * Calculate the text extents of the given UTF-8 string.
  *
@@ -230,6 +278,13 @@ struct wld_renderer
 {
     const struct wld_renderer_impl * const impl;
     struct wld_buffer * target;
+
+    /**
+     * If true, the bounds of what each drawing operation touches are added to
+     * the damage region of the target buffer. It remains there after
+     * wld_flush, for the client to submit and clear.
+     */
+    bool track_damage;
 };
 
 enum wld_capability
@@ -265,6 +320,20 @@ void wld_copy_region(struct wld_renderer * renderer,
                      struct wld_buffer * buffer,
                      int32_t dst_x, int32_t dst_y, pixman_region32_t * region);
 
+/**
+ * Move the contents of a rectangle of the target by dy rows, which may be
+ * negative, within that rectangle. The rows moved out of the rectangle are
+ * discarded and the rows uncovered keep their old contents. The rectangle
+ * is clipped to the target first.
+ *
+ * Unlike copying a rectangle of the target onto itself with
+ * wld_copy_rectangle, this is correct when the source and destination
+ * overlap.
+ */
+void wld_scroll_rectangle(struct wld_renderer * renderer,
+                          int32_t x, int32_t y, uint32_t width, uint32_t height,
+                          int32_t dy);
+
 /**
  * Draw a UTF-8 text string to the given buffer.
  *
@@ -278,7 +347,96 @@ void wld_draw_text(struct wld_renderer * renderer,
                    int32_t x, int32_t y, const char * text, uint32_t length,
                    struct wld_extents * extents);
 
+/**
+ * Draw a string of already decoded characters to the given buffer.
+ *
+ * @param length    The number of characters in the string.
+ * @param extents   If not NULL, will be initialized to the extents of the
+ *                  drawn text
+ */
+void wld_draw_chars(struct wld_renderer * renderer,
+                    struct wld_font * font, uint32_t color,
+                    int32_t x, int32_t y, const uint32_t * chars,
+                    uint32_t length, struct wld_extents * extents);
+
+enum wld_cell_flags
+{
+    WLD_CELL_UNDERLINE      = 1<<0,
+    WLD_CELL_STRUCK         = 1<<1,
+
+    /* Leave the background as it is. */
+    WLD_CELL_NO_BACKGROUND  = 1<<2,
+};
+
+struct wld_cell
+{
+    /* The character, in UTF-32, or 0 to draw none. */
+    uint32_t character;
+    uint32_t fg, bg;
+
+    /* The index of the font in wld_cell_layout.fonts. */
+    uint8_t font;
+    uint8_t flags;
+};
+
+struct wld_cell_layout
+{
+    /* The size of a cell. */
+    uint32_t width, height;
+
+    struct wld_font ** fonts;
+    uint32_t num_fonts;
+
+    /* The offsets of the underline and strike lines from the top of a cell. */
+    int32_t underline, strike;
+};
+
+/**
+ * Draw a row of cells of a character grid, the first with its top left
+ * corner at (x, y). Each cell gets its background, then its character, with
+ * the origin at the left of the cell and the ascent of its font below the
+ * top, and then the lines of its flags.
+ *
+ * Unlike drawing the row with wld_draw_chars, this takes one call however
+ * the colors and fonts change along the row.
+ */
+void wld_draw_cells(struct wld_renderer * renderer, int32_t x, int32_t y,
+                    const struct wld_cell * cells, uint32_t length,
+                    const struct wld_cell_layout * layout);
+
 void wld_flush(struct wld_renderer * renderer);
 
+/**** Display lists ****/
+
+struct wld_display_list;
+
+/**
+ * Create a renderer that records the operations drawn with it into a display
+ * list. If renderer is not NULL, flushing the recorder replays the operations
+ * recorded since the last flush with it, so that the recorder can stand in for
+ * it.
+ *
+ * The fonts drawn with must stay open as long as the list is kept.
+ */
+struct wld_renderer * wld_create_recorder(struct wld_renderer * renderer);
+
+/**
+ * Take the display list recorded so far, leaving the recorder with an empty
+ * one.
+ */
+struct wld_display_list * wld_recorder_take(struct wld_renderer * recorder);
+
+/**
+ * Execute the operations of a display list with a renderer.
+ */
+void wld_replay(struct wld_renderer * renderer, struct wld_display_list * list);
+
+/**
+ * Write the operations of a display list to a file, one per line.
+ */
+void wld_display_list_dump(struct wld_display_list * list, FILE * file);
+
+void wld_destroy_display_list(struct wld_display_list * list);
+
 #endif
 
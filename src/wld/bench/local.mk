@@ -0,0 +1,17 @@
+# wld: bench/local.mk
+
+dir := bench
+
+BENCH_OBJECTS = $(filter-out pixman.o,$(WLD_STATIC_OBJECTS))
+
+# The benchmark includes pixman.c itself, to reach its static fast paths.
+$(dir)/pixman: $(dir)/pixman.c pixman.c $(BENCH_OBJECTS)
+	$(call quiet,CCLD,$(CC)) $(FINAL_CPPFLAGS) $(FINAL_CFLAGS) $(LDFLAGS) \
+	    $(WLD_CPPFLAGS) $(WLD_PACKAGE_CFLAGS) -o $@ $< $(BENCH_OBJECTS) \
+	    $(WLD_PACKAGE_LIBS)
+
+.PHONY: bench
+bench: $(dir)/pixman
+	./$<
+
+CLEAN_FILES += $(dir)/pixman
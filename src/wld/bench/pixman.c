@@ -0,0 +1,230 @@
+/* wld: bench/pixman.c
+ *
+ * Times the fast paths of the pixman renderer against the pixman calls they
+ * replace, on terminal-sized cells of 32-bit targets. It is distributed under
+ * the same terms as wld, see COPYING.
+ */
+
+/* The fast paths are static, so they are built into the benchmark. */
+#include "../pixman.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CELL_WIDTH      10
+#define CELL_HEIGHT     20
+#define COLUMNS         80
+#define ROWS            30
+#define ITERATIONS      200
+
+/* The glyph's bitmap, with its top left corner 2 pixels below the top of the
+ * cell and its origin on the baseline at CELL_HEIGHT - 4. */
+#define GLYPH_WIDTH     8
+#define GLYPH_HEIGHT    14
+#define GLYPH_TOP       2
+#define BASELINE        (CELL_HEIGHT - 4)
+
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void report(const char * name, double fast, double slow)
+{
+    double cells = (double) COLUMNS * ROWS * ITERATIONS;
+
+    printf("%-28s %8.1f ns  pixman %8.1f ns  %5.2fx\n",
+           name, fast / cells * 1e9, slow / cells * 1e9, slow / fast);
+}
+
+static void bench_fill(struct pixman_renderer * renderer, const char * name)
+{
+    pixman_color_t color = PIXMAN_COLOR(0xff202020);
+    pixman_box32_t box;
+    double start, fast, slow;
+    uint32_t i, x, y;
+
+    start = now();
+
+    for (i = 0; i < ITERATIONS; ++i)
+    {
+        for (y = 0; y < ROWS; ++y)
+        {
+            for (x = 0; x < COLUMNS; ++x)
+            {
+                fast_fill(renderer, 0xff202020,
+                          x * CELL_WIDTH, y * CELL_HEIGHT,
+                          (x + 1) * CELL_WIDTH, (y + 1) * CELL_HEIGHT);
+            }
+        }
+    }
+
+    fast = now() - start;
+    start = now();
+
+    for (i = 0; i < ITERATIONS; ++i)
+    {
+        for (y = 0; y < ROWS; ++y)
+        {
+            for (x = 0; x < COLUMNS; ++x)
+            {
+                box = (pixman_box32_t) {
+                    x * CELL_WIDTH, y * CELL_HEIGHT,
+                    (x + 1) * CELL_WIDTH, (y + 1) * CELL_HEIGHT
+                };
+                pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
+                                        &color, 1, &box);
+            }
+        }
+    }
+
+    slow = now() - start;
+    report(name, fast, slow);
+}
+
+static void bench_glyph(struct pixman_renderer * renderer, const char * name,
+                        struct glyph * glyph, pixman_image_t * mask)
+{
+    pixman_color_t pixman_color = PIXMAN_COLOR(0xffd0d0d0);
+    pixman_image_t * solid;
+    double start, fast, slow;
+    uint32_t i, x, y;
+
+    start = now();
+
+    for (i = 0; i < ITERATIONS; ++i)
+    {
+        for (y = 0; y < ROWS; ++y)
+        {
+            for (x = 0; x < COLUMNS; ++x)
+            {
+                fast_glyph(renderer, 0xffd0d0d0,
+                           x * CELL_WIDTH, y * CELL_HEIGHT + BASELINE, glyph);
+            }
+        }
+    }
+
+    fast = now() - start;
+    solid = pixman_image_create_solid_fill(&pixman_color);
+    start = now();
+
+    for (i = 0; i < ITERATIONS; ++i)
+    {
+        for (y = 0; y < ROWS; ++y)
+        {
+            for (x = 0; x < COLUMNS; ++x)
+            {
+                pixman_image_composite32
+                    (PIXMAN_OP_OVER, solid, mask, renderer->target, 0, 0, 0, 0,
+                     x * CELL_WIDTH + glyph->x,
+                     y * CELL_HEIGHT + BASELINE + glyph->y,
+                     GLYPH_WIDTH, GLYPH_HEIGHT);
+            }
+        }
+    }
+
+    slow = now() - start;
+    pixman_image_unref(solid);
+    report(name, fast, slow);
+}
+
+int main(void)
+{
+    static const struct
+    {
+        pixman_format_code_t format;
+        const char * name;
+    } formats[] = {
+        { PIXMAN_a8r8g8b8, "argb8888" },
+        { PIXMAN_x8r8g8b8, "xrgb8888" },
+    };
+    uint8_t gray[GLYPH_HEIGHT][GLYPH_WIDTH], mono[GLYPH_HEIGHT];
+    struct glyph a8 = { .x = 1, .y = GLYPH_TOP - BASELINE },
+                 a1 = { .x = 1, .y = GLYPH_TOP - BASELINE };
+    struct pixman_renderer renderer = { .glyph_cache = NULL };
+    pixman_image_t * a8_mask, * a1_mask;
+    uint8_t * row;
+    char name[64];
+    uint32_t i, x, y;
+
+    /* Some ink, some coverage in between and some blank pixels, like the
+     * strokes of a letter. */
+    for (y = 0; y < GLYPH_HEIGHT; ++y)
+    {
+        mono[y] = 0;
+
+        for (x = 0; x < GLYPH_WIDTH; ++x)
+        {
+            gray[y][x] = (x + y) % 3 == 0 ? 0xff : (x * y) % 5 == 0 ? 0x80 : 0;
+
+            if (gray[y][x] >= 0x80)
+                mono[y] |= 0x80 >> x;
+        }
+    }
+
+    a8.bitmap = (FT_Bitmap) {
+        .rows = GLYPH_HEIGHT, .width = GLYPH_WIDTH, .pitch = GLYPH_WIDTH,
+        .buffer = &gray[0][0], .pixel_mode = FT_PIXEL_MODE_GRAY,
+    };
+    a1.bitmap = (FT_Bitmap) {
+        .rows = GLYPH_HEIGHT, .width = GLYPH_WIDTH, .pitch = 1,
+        .buffer = mono, .pixel_mode = FT_PIXEL_MODE_MONO,
+    };
+
+    /* The masks pixman composites, as cached_glyph makes them. */
+    a8_mask = pixman_image_create_bits(PIXMAN_a8, GLYPH_WIDTH, GLYPH_HEIGHT,
+                                       NULL, 0);
+    a1_mask = pixman_image_create_bits(PIXMAN_a1, GLYPH_WIDTH, GLYPH_HEIGHT,
+                                       NULL, 0);
+
+    if (!a8_mask || !a1_mask)
+        return EXIT_FAILURE;
+
+    for (y = 0; y < GLYPH_HEIGHT; ++y)
+    {
+        row = (uint8_t *) pixman_image_get_data(a8_mask)
+            + y * pixman_image_get_stride(a8_mask);
+        memcpy(row, gray[y], GLYPH_WIDTH);
+        row = (uint8_t *) pixman_image_get_data(a1_mask)
+            + y * pixman_image_get_stride(a1_mask);
+        row[0] = reverse(mono[y]);
+    }
+
+    printf("%u cells of %ux%u, %u times, per cell:\n",
+           COLUMNS * ROWS, CELL_WIDTH, CELL_HEIGHT, ITERATIONS);
+
+    for (i = 0; i < ARRAY_LENGTH(formats); ++i)
+    {
+        renderer.target = pixman_image_create_bits
+            (formats[i].format, COLUMNS * CELL_WIDTH, ROWS * CELL_HEIGHT,
+             NULL, 0);
+
+        if (!renderer.target)
+            return EXIT_FAILURE;
+
+        set_target_bits(&renderer);
+
+        if (!renderer.bits)
+            return EXIT_FAILURE;
+
+        snprintf(name, sizeof name, "fill %s", formats[i].name);
+        bench_fill(&renderer, name);
+        snprintf(name, sizeof name, "a8 glyph %s", formats[i].name);
+        bench_glyph(&renderer, name, &a8, a8_mask);
+        snprintf(name, sizeof name, "a1 glyph %s", formats[i].name);
+        bench_glyph(&renderer, name, &a1, a1_mask);
+
+        pixman_image_unref(renderer.target);
+    }
+
+    pixman_image_unref(a8_mask);
+    pixman_image_unref(a1_mask);
+
+    return EXIT_SUCCESS;
+}
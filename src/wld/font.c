@@ -24,6 +24,146 @@
 #include "wld-private.h"
 
 #include <fontconfig/fcfreetype.h>
+#include FT_OUTLINE_H
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GLYPH_PAGE_BITS 7
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_BITS)
+#define ARENA_CHUNK_SIZE 16384
+#define MONO_LOAD_FLAGS \
+    (FT_LOAD_RENDER | FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO)
+
+#define GLYPH_CACHE_MAGIC 0x63646c77 /* "wldc" */
+#define GLYPH_CACHE_VERSION 1
+
+/**
+ * A glyph cache file is this header, followed by the name of the font file
+ * (padded to 8 bytes), the entries and then the bitmaps.
+ */
+struct glyph_cache_header
+{
+    uint32_t magic, version;
+    uint32_t load_flags;
+    uint32_t num_entries;
+    int64_t file_mtime;
+    uint64_t file_size;
+    double pixel_size, aspect;
+    uint32_t file_length;
+    uint32_t synthetic;
+};
+
+struct glyph_cache_entry
+{
+    uint32_t character, index;
+    int16_t x, y;
+    uint16_t advance;
+    uint8_t pixel_mode;
+    uint8_t padding;
+    uint32_t width, rows;
+    int32_t pitch;
+
+    /* The offset of the bitmap from the start of the file. */
+    uint32_t offset;
+};
+
+/* Marks characters the font has no glyph for. */
+static struct glyph no_glyph;
+
+struct font_arena
+{
+    struct font_arena * next;
+    size_t size, used;
+    uint8_t data[];
+};
+
+static void * arena_alloc(struct font * font, size_t size)
+{
+    struct font_arena * arena = font->arena;
+    void * data;
+
+    size = (size + 7) & ~(size_t) 7;
+
+    if (!arena || arena->used + size > arena->size)
+    {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+        arena = malloc(sizeof *arena + chunk_size);
+
+        if (!arena)
+            return NULL;
+
+        arena->size = chunk_size;
+        arena->used = 0;
+        arena->next = font->arena;
+        font->arena = arena;
+        font->memory += sizeof *arena + chunk_size;
+    }
+
+    data = arena->data + arena->used;
+    arena->used += size;
+
+    return data;
+}
+
+/**
+ * Returns the FreeType load flags for the antialiasing and hinting settings
+ * of a fontconfig match.
+ */
+static FT_Int32 pattern_load_flags(FcPattern * match)
+{
+    FcBool antialias, hinting, autohint;
+    int hint_style;
+    FT_Int32 flags = FT_LOAD_RENDER;
+
+    if (FcPatternGetBool(match, FC_ANTIALIAS, 0, &antialias) != FcResultMatch)
+        antialias = FcTrue;
+    if (FcPatternGetBool(match, FC_HINTING, 0, &hinting) != FcResultMatch)
+        hinting = FcTrue;
+    if (FcPatternGetInteger(match, FC_HINT_STYLE, 0, &hint_style)
+        != FcResultMatch)
+    {
+        hint_style = FC_HINT_FULL;
+    }
+    if (FcPatternGetBool(match, FC_AUTOHINT, 0, &autohint) != FcResultMatch)
+        autohint = FcFalse;
+
+    if (!antialias)
+        return MONO_LOAD_FLAGS;
+
+    if (!hinting || hint_style == FC_HINT_NONE)
+        flags |= FT_LOAD_NO_HINTING;
+    else if (hint_style == FC_HINT_SLIGHT)
+        flags |= FT_LOAD_TARGET_LIGHT;
+    else
+        flags |= FT_LOAD_TARGET_NORMAL;
+
+    if (autohint)
+        flags |= FT_LOAD_FORCE_AUTOHINT;
+
+    return flags;
+}
+
+/**
+ * Fonts may be opened and closed on several threads, and font ids must stay
+ * unique across them.
+ */
+static uintptr_t next_font_id(struct wld_font_context * context)
+{
+    return __atomic_fetch_add(&context->next_font_id, 1, __ATOMIC_RELAXED);
+}
+
+static void done_face(struct wld_font_context * context, FT_Face face)
+{
+    pthread_mutex_lock(&context->lock);
+    FT_Done_Face(face);
+    pthread_mutex_unlock(&context->lock);
+}
 
 EXPORT
 struct wld_font_context * wld_font_create_context()
@@ -35,15 +175,22 @@ struct wld_font_context * wld_font_create_context()
     if (!context)
         goto error0;
 
+    context->next_font_id = 1;
+
+    if (pthread_mutex_init(&context->lock, NULL) != 0)
+        goto error1;
+
     if (FT_Init_FreeType(&context->library) != 0)
     {
         DEBUG("Failed to initialize FreeType library\n");
 
-        goto error1;
+        goto error2;
     }
 
     return context;
 
+  error2:
+    pthread_mutex_destroy(&context->lock);
   error1:
     free(context);
   error0:
@@ -54,6 +201,7 @@ EXPORT
 void wld_font_destroy_context(struct wld_font_context * context)
 {
     FT_Done_FreeType(context->library);
+    pthread_mutex_destroy(&context->lock);
     free(context);
 }
 
@@ -93,6 +241,18 @@ struct wld_font * wld_font_open_pattern(struct wld_font_context * context,
         goto error0;
 
     font->context = context;
+    font->arena = NULL;
+    font->file = NULL;
+    font->file_mtime = 0;
+    font->file_size = 0;
+    font->synthetic = 0;
+    font->load_flags = pattern_load_flags(match);
+    font->hits = font->misses = font->glyphs = 0;
+    font->memory = 0;
+    font->cache = NULL;
+    font->cache_size = 0;
+    memset(font->char_glyphs, 0, sizeof font->char_glyphs);
+    memset(font->char_hash, 0, sizeof font->char_hash);
 
     result = FcPatternGetString(match, FC_FILE, 0, (FcChar8 **) &filename);
 
@@ -102,10 +262,22 @@ struct wld_font * wld_font_open_pattern(struct wld_font_context * context,
 
         DEBUG("Loading font file: %s\n", filename);
 
+        pthread_mutex_lock(&context->lock);
         error = FT_New_Face(context->library, filename, 0, &font->face);
+        pthread_mutex_unlock(&context->lock);
 
         if (error == 0)
+        {
+            struct stat st;
+
+            if (stat(filename, &st) == 0 && (font->file = strdup(filename)))
+            {
+                font->file_mtime = st.st_mtime;
+                font->file_size = st.st_size;
+            }
+
             goto load_face;
+        }
     }
 
     result = FcPatternGetFTFace(match, FC_FT_FACE, 0, &font->face);
@@ -124,6 +296,9 @@ struct wld_font * wld_font_open_pattern(struct wld_font_context * context,
     if (result == FcResultNoMatch)
         aspect = 1.0;
 
+    font->pixel_size = pixel_size;
+    font->aspect = aspect;
+
     if (font->face->face_flags & FT_FACE_FLAG_SCALABLE)
     {
         FT_F26Dot6 width, height;
@@ -144,10 +319,68 @@ struct wld_font * wld_font_open_pattern(struct wld_font_context * context,
     font->base.height = font->base.ascent + font->base.descent;
     font->base.max_advance = font->face->size->metrics.max_advance >> 6;
 
-    font->glyphs = calloc(font->face->num_glyphs, sizeof(struct glyph *));
+    font->glyph_pages = calloc((font->face->num_glyphs + GLYPH_PAGE_SIZE - 1)
+                               >> GLYPH_PAGE_BITS, sizeof *font->glyph_pages);
+
+    if (!font->glyph_pages)
+        goto error2;
+
+    font->memory += ((font->face->num_glyphs + GLYPH_PAGE_SIZE - 1)
+                     >> GLYPH_PAGE_BITS) * sizeof *font->glyph_pages;
+    font->id = next_font_id(context);
+
+    return &font->base;
+
+  error2:
+    free(font->file);
+    done_face(context, font->face);
+  error1:
+    free(font);
+  error0:
+    return NULL;
+}
+
+EXPORT
+struct wld_font * wld_font_open_synthetic(struct wld_font * base_base,
+                                          uint32_t styles)
+{
+    struct font * base = (void *) base_base;
+    struct font * font;
+
+    font = malloc(sizeof *font);
+
+    if (!font)
+        goto error0;
+
+    *font = *base;
+    font->arena = NULL;
+    font->cache = NULL;
+    font->cache_size = 0;
+    font->synthetic = base->synthetic | styles;
+    font->hits = font->misses = font->glyphs = 0;
+    font->memory = ((font->face->num_glyphs + GLYPH_PAGE_SIZE - 1)
+                    >> GLYPH_PAGE_BITS) * sizeof *font->glyph_pages;
+    memset(font->char_glyphs, 0, sizeof font->char_glyphs);
+    memset(font->char_hash, 0, sizeof font->char_hash);
+
+    if (base->file && !(font->file = strdup(base->file)))
+        goto error1;
+
+    font->glyph_pages = calloc((font->face->num_glyphs + GLYPH_PAGE_SIZE - 1)
+                               >> GLYPH_PAGE_BITS, sizeof *font->glyph_pages);
+
+    if (!font->glyph_pages)
+        goto error2;
+
+    pthread_mutex_lock(&font->context->lock);
+    FT_Reference_Face(font->face);
+    pthread_mutex_unlock(&font->context->lock);
+    font->id = next_font_id(font->context);
 
     return &font->base;
 
+  error2:
+    free(font->file);
   error1:
     free(font);
   error0:
@@ -158,54 +391,456 @@ EXPORT
 void wld_font_close(struct wld_font * font_base)
 {
     struct font * font = (void *) font_base;
+    struct font_arena * arena, * next;
+
+    for (arena = font->arena; arena; arena = next)
+    {
+        next = arena->next;
+        free(arena);
+    }
 
-    FT_Done_Face(font->face);
+    if (font->cache)
+        munmap(font->cache, font->cache_size);
+
+    free(font->glyph_pages);
+    free(font->file);
+    done_face(font->context, font->face);
     free(font);
 }
 
-bool font_ensure_glyph(struct font * font, FT_UInt glyph_index)
+/**
+ * Returns the slot of the glyph with the given index, allocating its page if
+ * necessary.
+ */
+static struct glyph ** glyph_slot(struct font * font, FT_UInt glyph_index)
 {
-    if (glyph_index)
+    struct glyph ** page;
+
+    page = font->glyph_pages[glyph_index >> GLYPH_PAGE_BITS];
+
+    if (!page)
     {
-        if (!font->glyphs[glyph_index])
+        page = arena_alloc(font, GLYPH_PAGE_SIZE * sizeof *page);
+
+        if (!page)
+            return NULL;
+
+        memset(page, 0, GLYPH_PAGE_SIZE * sizeof *page);
+        font->glyph_pages[glyph_index >> GLYPH_PAGE_BITS] = page;
+    }
+
+    return &page[glyph_index & (GLYPH_PAGE_SIZE - 1)];
+}
+
+/**
+ * Returns the slot of the glyph for the given character.
+ */
+static struct glyph ** char_slot(struct font * font, uint32_t character)
+{
+    uint32_t slot;
+
+    if (character < FONT_CHAR_DIRECT)
+        return &font->char_glyphs[character];
+
+    slot = character % FONT_CHAR_HASH;
+
+    if (font->char_hash[slot].character != character)
+    {
+        font->char_hash[slot].character = character;
+        font->char_hash[slot].glyph = NULL;
+    }
+
+    return &font->char_hash[slot].glyph;
+}
+
+/**
+ * Loads and renders the glyph into the glyph slot of the face, applying the
+ * synthetic styles of the font to its outline. Glyphs that only have bitmaps
+ * are loaded without them.
+ */
+static bool load_synthetic_glyph(struct font * font, FT_UInt glyph_index)
+{
+    FT_GlyphSlot slot = font->face->glyph;
+
+    if (FT_Load_Glyph(font->face, glyph_index, FT_LOAD_NO_BITMAP
+                      | (font->load_flags & ~FT_LOAD_RENDER)) != 0
+        || slot->format != FT_GLYPH_FORMAT_OUTLINE)
+    {
+        return FT_Load_Glyph(font->face, glyph_index, font->load_flags) == 0;
+    }
+
+    if (font->synthetic & WLD_FONT_BOLD)
+    {
+        /* The same strength as FT_GlyphSlot_Embolden, but keeping the
+         * advance, so the glyph still fits the cell. */
+        FT_Outline_Embolden(&slot->outline,
+                            FT_MulFix(font->face->units_per_EM,
+                                      font->face->size->metrics.y_scale) / 24);
+    }
+
+    if (font->synthetic & WLD_FONT_ITALIC)
+    {
+        /* The shear of FT_GlyphSlot_Oblique, about 12 degrees. */
+        FT_Matrix shear = { 0x10000, 0x0366A, 0, 0x10000 };
+
+        FT_Outline_Transform(&slot->outline, &shear);
+    }
+
+    return FT_Render_Glyph(slot, FT_LOAD_TARGET_MODE(font->load_flags)) == 0;
+}
+
+struct glyph * font_ensure_glyph(struct font * font, FT_UInt glyph_index)
+{
+    struct glyph ** slot, * glyph;
+    FT_Bitmap * bitmap;
+    size_t size;
+
+    if (!glyph_index || glyph_index >= font->face->num_glyphs)
+        return NULL;
+
+    if (!(slot = glyph_slot(font, glyph_index)))
+        return NULL;
+
+    if (*slot)
+        return *slot;
+
+    if (font->synthetic)
+    {
+        if (!load_synthetic_glyph(font, glyph_index))
+            return NULL;
+    }
+    else if (FT_Load_Glyph(font->face, glyph_index, font->load_flags) != 0)
+        return NULL;
+
+    bitmap = &font->face->glyph->bitmap;
+    size = abs(bitmap->pitch) * bitmap->rows;
+
+    /* The bitmap is stored right after the glyph. */
+    glyph = arena_alloc(font, sizeof *glyph + size);
+
+    if (!glyph)
+        return NULL;
+
+    glyph->bitmap = *bitmap;
+    glyph->bitmap.buffer = (unsigned char *) (glyph + 1);
+    memcpy(glyph->bitmap.buffer, bitmap->buffer, size);
+
+    glyph->advance = font->face->glyph->metrics.horiAdvance >> 6;
+    glyph->x = font->face->glyph->bitmap_left;
+    glyph->y = -font->face->glyph->bitmap_top;
+    glyph->index = glyph_index;
+    glyph->mono = NULL;
+    ++font->glyphs;
+
+    *slot = glyph;
+
+    return glyph;
+}
+
+struct glyph * font_ensure_char(struct font * font, uint32_t character)
+{
+    struct glyph ** glyph;
+    FT_UInt glyph_index;
+
+    glyph = char_slot(font, character);
+
+    if (!*glyph)
+    {
+        ++font->misses;
+        glyph_index = FT_Get_Char_Index(font->face, character);
+
+        if (!(*glyph = font_ensure_glyph(font, glyph_index)))
+            *glyph = &no_glyph;
+    }
+    else
+        ++font->hits;
+
+    return *glyph == &no_glyph ? NULL : *glyph;
+}
+
+bool font_mono_bitmap(struct font * font, struct glyph * glyph,
+                      FT_Bitmap * bitmap)
+{
+    uint32_t row, column, pitch;
+    uint8_t * src, * dst;
+
+    *bitmap = glyph->bitmap;
+
+    if (glyph->bitmap.pixel_mode == FT_PIXEL_MODE_MONO)
+        return true;
+
+    if (glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+        return false;
+
+    pitch = (glyph->bitmap.width + 7) / 8;
+
+    if (!glyph->mono)
+    {
+        if (!(glyph->mono = arena_alloc(font, pitch * glyph->bitmap.rows)))
+            return false;
+
+        memset(glyph->mono, 0, pitch * glyph->bitmap.rows);
+        src = glyph->bitmap.buffer;
+        dst = glyph->mono;
+
+        for (row = 0; row < glyph->bitmap.rows; ++row)
         {
-            struct glyph * glyph;
+            for (column = 0; column < glyph->bitmap.width; ++column)
+            {
+                if (src[column] >= 0x80)
+                    dst[column / 8] |= 0x80 >> (column % 8);
+            }
+
+            src += glyph->bitmap.pitch;
+            dst += pitch;
+        }
+    }
+
+    bitmap->buffer = glyph->mono;
+    bitmap->pitch = pitch;
+    bitmap->pixel_mode = FT_PIXEL_MODE_MONO;
+    bitmap->num_grays = 2;
+
+    return true;
+}
+
+EXPORT
+bool wld_font_ensure_char(struct wld_font * font_base, uint32_t character)
+{
+    struct font * font = (void *) font_base;
 
-            glyph = malloc(sizeof *glyph);
+    return font_ensure_char(font, character) != NULL;
+}
 
-            if (!glyph)
-                return false;
+EXPORT
+void wld_font_get_stats(struct wld_font * font_base,
+                        struct wld_font_stats * stats)
+{
+    struct font * font = (void *) font_base;
+
+    stats->hits = font->hits;
+    stats->misses = font->misses;
+    stats->glyphs = font->glyphs;
+    stats->memory = font->memory;
+    stats->mapped = font->cache_size;
+}
 
-            FT_Load_Glyph(font->face, glyph_index, FT_LOAD_RENDER
-                          | FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO);
+EXPORT
+bool wld_font_read_glyph_cache(struct wld_font * font_base, const char * path)
+{
+    struct font * font = (void *) font_base;
+    const struct glyph_cache_header * header;
+    const struct glyph_cache_entry * entries, * entry;
+    struct glyph ** slot;
+    struct stat st;
+    uint8_t * map;
+    size_t entries_offset;
+    uint32_t i;
+    int fd;
+
+    if (!font->file || font->cache)
+        goto error0;
 
-            FT_Bitmap_New(&glyph->bitmap);
+    if ((fd = open(path, O_RDONLY)) == -1)
+        goto error0;
 
-            FT_Bitmap_Copy(font->context->library,
-                           &font->face->glyph->bitmap, &glyph->bitmap);
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof *header)
+        goto error1;
 
-            glyph->advance = font->face->glyph->metrics.horiAdvance >> 6;
-            glyph->x = font->face->glyph->bitmap_left;
-            glyph->y = -font->face->glyph->bitmap_top;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-            font->glyphs[glyph_index] = glyph;
+    if (map == MAP_FAILED)
+        goto error1;
+
+    close(fd);
+    header = (const void *) map;
+    entries_offset = sizeof *header + ((header->file_length + 8) & ~7);
+
+    if (header->magic != GLYPH_CACHE_MAGIC
+        || header->version != GLYPH_CACHE_VERSION
+        || header->load_flags != font->load_flags
+        || header->file_mtime != font->file_mtime
+        || header->file_size != font->file_size
+        || header->pixel_size != font->pixel_size
+        || header->aspect != font->aspect
+        || header->synthetic != font->synthetic
+        || header->file_length != strlen(font->file)
+        || entries_offset + (uint64_t) header->num_entries * sizeof *entry
+           > st.st_size
+        || memcmp(map + sizeof *header, font->file, header->file_length) != 0)
+    {
+        DEBUG("Glyph cache %s is stale\n", path);
+        goto error2;
+    }
+
+    entries = (const void *) (map + entries_offset);
+
+    for (i = 0; i < header->num_entries; ++i)
+    {
+        struct glyph * glyph;
+
+        entry = &entries[i];
+
+        if (!entry->index || entry->index >= font->face->num_glyphs
+            || (uint64_t) entry->offset + (uint64_t) abs(entry->pitch)
+               * entry->rows > st.st_size)
+        {
+            continue;
         }
 
-        return true;
+        if (!(slot = glyph_slot(font, entry->index)))
+            break;
+
+        if (!(glyph = *slot))
+        {
+            if (!(glyph = arena_alloc(font, sizeof *glyph)))
+                break;
+
+            memset(&glyph->bitmap, 0, sizeof glyph->bitmap);
+            glyph->bitmap.width = entry->width;
+            glyph->bitmap.rows = entry->rows;
+            glyph->bitmap.pitch = entry->pitch;
+            glyph->bitmap.pixel_mode = entry->pixel_mode;
+            glyph->bitmap.num_grays =
+                entry->pixel_mode == FT_PIXEL_MODE_MONO ? 2 : 256;
+            glyph->bitmap.buffer = map + entry->offset;
+            glyph->x = entry->x;
+            glyph->y = entry->y;
+            glyph->advance = entry->advance;
+            glyph->index = entry->index;
+            glyph->mono = NULL;
+            ++font->glyphs;
+            *slot = glyph;
+        }
+
+        *char_slot(font, entry->character) = glyph;
     }
 
+    font->cache = map;
+    font->cache_size = st.st_size;
+
+    return true;
+
+  error2:
+    munmap(map, st.st_size);
+    return false;
+  error1:
+    close(fd);
+  error0:
     return false;
 }
 
 EXPORT
-bool wld_font_ensure_char(struct wld_font * font_base, uint32_t character)
+bool wld_font_write_glyph_cache(struct wld_font * font_base, const char * path)
 {
     struct font * font = (void *) font_base;
-    FT_UInt glyph_index;
+    struct glyph_cache_header header;
+    struct glyph_cache_entry entry;
+    static const uint8_t padding[8];
+    struct glyph * glyphs[FONT_CHAR_DIRECT + FONT_CHAR_HASH], * glyph;
+    uint32_t characters[FONT_CHAR_DIRECT + FONT_CHAR_HASH];
+    uint32_t i, count = 0, offset;
+    size_t path_length;
+    char * tmp;
+    FILE * file;
+    int fd;
+
+    if (!font->file)
+        goto error0;
+
+    for (i = 0; i < FONT_CHAR_DIRECT; ++i)
+    {
+        if ((glyph = font->char_glyphs[i]) && glyph != &no_glyph)
+        {
+            characters[count] = i;
+            glyphs[count++] = glyph;
+        }
+    }
 
-    glyph_index = FT_Get_Char_Index(font->face, character);
+    for (i = 0; i < FONT_CHAR_HASH; ++i)
+    {
+        if ((glyph = font->char_hash[i].glyph) && glyph != &no_glyph)
+        {
+            characters[count] = font->char_hash[i].character;
+            glyphs[count++] = glyph;
+        }
+    }
+
+    memset(&header, 0, sizeof header);
+    header.magic = GLYPH_CACHE_MAGIC;
+    header.version = GLYPH_CACHE_VERSION;
+    header.load_flags = font->load_flags;
+    header.num_entries = count;
+    header.file_mtime = font->file_mtime;
+    header.file_size = font->file_size;
+    header.pixel_size = font->pixel_size;
+    header.aspect = font->aspect;
+    header.file_length = strlen(font->file);
+    header.synthetic = font->synthetic;
+
+    /* Write to a temporary file first so readers never see a partial one. */
+    path_length = strlen(path);
+
+    if (!(tmp = malloc(path_length + 8)))
+        goto error0;
+
+    memcpy(tmp, path, path_length);
+    memcpy(tmp + path_length, ".XXXXXX", 8);
+
+    if ((fd = mkstemp(tmp)) == -1)
+        goto error1;
+
+    if (!(file = fdopen(fd, "w")))
+    {
+        close(fd);
+        goto error2;
+    }
+
+    fwrite(&header, sizeof header, 1, file);
+    fwrite(font->file, 1, header.file_length, file);
+    fwrite(padding, 1, 8 - header.file_length % 8, file);
+
+    offset = sizeof header + ((header.file_length + 8) & ~7)
+           + count * sizeof entry;
 
-    return font_ensure_glyph(font, glyph_index);
+    for (i = 0; i < count; ++i)
+    {
+        glyph = glyphs[i];
+        memset(&entry, 0, sizeof entry);
+        entry.character = characters[i];
+        entry.index = glyph->index;
+        entry.x = glyph->x;
+        entry.y = glyph->y;
+        entry.advance = glyph->advance;
+        entry.pixel_mode = glyph->bitmap.pixel_mode;
+        entry.width = glyph->bitmap.width;
+        entry.rows = glyph->bitmap.rows;
+        entry.pitch = glyph->bitmap.pitch;
+        entry.offset = offset;
+        fwrite(&entry, sizeof entry, 1, file);
+        offset += abs(glyph->bitmap.pitch) * glyph->bitmap.rows;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        glyph = glyphs[i];
+        fwrite(glyph->bitmap.buffer, 1,
+               abs(glyph->bitmap.pitch) * glyph->bitmap.rows, file);
+    }
+
+    if (fclose(file) != 0 || rename(tmp, path) != 0)
+        goto error2;
+
+    free(tmp);
+
+    return true;
+
+  error2:
+    unlink(tmp);
+  error1:
+    free(tmp);
+  error0:
+    return false;
 }
 
 EXPORT
@@ -216,7 +851,7 @@ void wld_font_text_extents_n(struct wld_font * font_base,
     struct font * font = (void *) font_base;
     int ret;
     uint32_t c;
-    FT_UInt glyph_index;
+    struct glyph * glyph;
 
     extents->advance = 0;
 
@@ -224,12 +859,10 @@ void wld_font_text_extents_n(struct wld_font * font_base,
     {
         length -= ret;
         text += ret;
-        glyph_index = FT_Get_Char_Index(font->face, c);
-
-        if (!font_ensure_glyph(font, glyph_index))
+        if (!(glyph = font_ensure_char(font, c)))
             continue;
 
-        extents->advance += font->glyphs[glyph_index]->advance;
+        extents->advance += glyph->advance;
     }
 }
 
@@ -158,6 +158,10 @@ struct buffer * context_create_buffer(struct wld_context * base,
     uint32_t tiling_mode = width >= 128 && !(flags & WLD_FLAG_CURSOR) ? I915_TILING_X : I915_TILING_NONE;
     unsigned long pitch;
 
+    /* The blits are all set up for 32-bit pixels. */
+    if (format_bytes_per_pixel(format) != 4)
+        goto error0;
+
     bo = drm_intel_bo_alloc_tiled(context->bufmgr, "buffer", width, height, 4,
                                   &tiling_mode, &pitch, 0);
 
@@ -272,16 +276,16 @@ void renderer_copy_rectangle(struct wld_renderer * base,
 
 void renderer_draw_text(struct wld_renderer * base,
                         struct font * font, uint32_t color,
-                        int32_t x, int32_t y, const char * text,
-                        uint32_t length, struct wld_extents * extents)
+                        int32_t x, int32_t y, const uint32_t * chars,
+                        uint32_t length, struct wld_extents * extents,
+                        pixman_box32_t * ink)
 {
     struct intel_renderer * renderer = intel_renderer(base);
     struct intel_buffer * dst = renderer->target;
     int ret;
     struct glyph * glyph;
-    uint32_t row;
-    FT_UInt glyph_index;
-    uint32_t c;
+    FT_Bitmap bitmap;
+    uint32_t row, i;
     uint8_t immediate[512];
     uint8_t * byte;
     int32_t origin_x = x;
@@ -289,38 +293,37 @@ void renderer_draw_text(struct wld_renderer * base,
     xy_setup_blt(&renderer->batch, true, BLT_RASTER_OPERATION_SRC,
                  0, color, dst->bo, dst->base.base.pitch);
 
-    if (length == -1)
-        length = strlen(text);
-
-    while ((ret = FcUtf8ToUcs4((FcChar8 *) text, &c, length)) > 0 && c != '\0')
+    for (i = 0; i < length; ++i)
     {
-        text += ret;
-        length -= ret;
-        glyph_index = FT_Get_Char_Index(font->face, c);
-
-        if (!font_ensure_glyph(font, glyph_index))
+        if (!(glyph = font_ensure_char(font, chars[i])))
             continue;
 
-        glyph = font->glyphs[glyph_index];
-
         if (glyph->bitmap.width == 0 || glyph->bitmap.rows == 0)
             goto advance;
 
+        if (ink)
+            glyph_extend_ink(glyph, origin_x, y, ink);
+
+        /* The blitter only draws 1 bit per pixel, so grayscale glyphs are
+         * thresholded. */
+        if (!font_mono_bitmap(font, glyph, &bitmap))
+            goto advance;
+
         byte = immediate;
 
         /* XY_TEXT_IMMEDIATE requires a pitch with no extra bytes */
-        for (row = 0; row < glyph->bitmap.rows; ++row)
+        for (row = 0; row < bitmap.rows; ++row)
         {
-            memcpy(byte, glyph->bitmap.buffer + (row * glyph->bitmap.pitch),
-                   (glyph->bitmap.width + 7) / 8);
-            byte += (glyph->bitmap.width + 7) / 8;
+            memcpy(byte, bitmap.buffer + (row * bitmap.pitch),
+                   (bitmap.width + 7) / 8);
+            byte += (bitmap.width + 7) / 8;
         }
 
       retry:
         ret = xy_text_immediate_blt(&renderer->batch, dst->bo,
                                     origin_x + glyph->x, y + glyph->y,
-                                    origin_x + glyph->x + glyph->bitmap.width,
-                                    y + glyph->y + glyph->bitmap.rows,
+                                    origin_x + glyph->x + bitmap.width,
+                                    y + glyph->y + bitmap.rows,
                                     (byte - immediate + 3) / 4,
                                     (uint32_t *) immediate);
 
@@ -41,11 +41,25 @@ static void renderer_copy_region(struct wld_renderer * base,
                                  int32_t dst_x, int32_t dst_y,
                                  pixman_region32_t * region);
 #endif
+#ifdef RENDERER_IMPLEMENTS_SCROLL
+static void renderer_scroll_rectangle(struct wld_renderer * renderer,
+                                      int32_t x, int32_t y,
+                                      uint32_t width, uint32_t height,
+                                      int32_t dy);
+#endif
 static void renderer_draw_text(struct wld_renderer * renderer,
                                struct font * font, uint32_t color,
                                int32_t x, int32_t y,
-                               const char * text, uint32_t length,
-                               struct wld_extents * extents);
+                               const uint32_t * chars, uint32_t length,
+                               struct wld_extents * extents,
+                               pixman_box32_t * ink);
+#ifdef RENDERER_IMPLEMENTS_CELLS
+static void renderer_draw_cells(struct wld_renderer * renderer,
+                                int32_t x, int32_t y,
+                                const struct wld_cell * cells, uint32_t length,
+                                const struct wld_cell_layout * layout,
+                                pixman_box32_t * ink);
+#endif
 static void renderer_flush(struct wld_renderer * renderer);
 static void renderer_destroy(struct wld_renderer * renderer);
 
@@ -60,8 +74,18 @@ static const struct wld_renderer_impl wld_renderer_impl = {
 #else
     .fill_region = &default_fill_region,
     .copy_region = &default_copy_region,
+#endif
+#ifdef RENDERER_IMPLEMENTS_SCROLL
+    .scroll_rectangle = &renderer_scroll_rectangle,
+#else
+    .scroll_rectangle = &default_scroll_rectangle,
 #endif
     .draw_text = &renderer_draw_text,
+#ifdef RENDERER_IMPLEMENTS_CELLS
+    .draw_cells = &renderer_draw_cells,
+#else
+    .draw_cells = &default_draw_cells,
+#endif
     .flush = &renderer_flush,
     .destroy = &renderer_destroy
 };
@@ -350,6 +350,9 @@ struct buffer * context_create_buffer(struct wld_context * base,
              pitch = roundup(width * bpp, 64), bo_flags;
     union nouveau_bo_config config = { };
 
+    if (!nvc0_format(format))
+        goto error0;
+
     if (!(buffer = new_buffer(context, width, height, format, pitch)))
         goto error0;
 
@@ -541,16 +544,16 @@ void renderer_copy_rectangle(struct wld_renderer * base,
 
 void renderer_draw_text(struct wld_renderer * base,
                         struct font * font, uint32_t color,
-                        int32_t x, int32_t y, const char * text,
-                        uint32_t length, struct wld_extents * extents)
+                        int32_t x, int32_t y, const uint32_t * chars,
+                        uint32_t length, struct wld_extents * extents,
+                        pixman_box32_t * ink)
 {
     struct nouveau_renderer * renderer = nouveau_renderer(base);
     struct nouveau_buffer * dst = renderer->target;
     uint32_t format;
-    int ret;
     struct glyph * glyph;
-    FT_UInt glyph_index;
-    uint32_t c, count;
+    FT_Bitmap bitmap;
+    uint32_t i, count;
     int32_t origin_x = x;
 
     if (!ensure_space(renderer->pushbuf, 17))
@@ -573,24 +576,23 @@ void renderer_draw_text(struct wld_renderer * base,
     if (nouveau_pushbuf_validate(renderer->pushbuf) != 0)
         return;
 
-    if (length == -1)
-        length = strlen(text);
-
-    while ((ret = FcUtf8ToUcs4((FcChar8 *) text, &c, length)) > 0 && c != '\0')
+    for (i = 0; i < length; ++i)
     {
-        text += ret;
-        length -= ret;
-        glyph_index = FT_Get_Char_Index(font->face, c);
-
-        if (!font_ensure_glyph(font, glyph_index))
+        if (!(glyph = font_ensure_char(font, chars[i])))
             continue;
 
-        glyph = font->glyphs[glyph_index];
-
         if (glyph->bitmap.width == 0 || glyph->bitmap.rows == 0)
             goto advance;
 
-        count = (glyph->bitmap.pitch * glyph->bitmap.rows + 3) / 4;
+        if (ink)
+            glyph_extend_ink(glyph, origin_x, y, ink);
+
+        /* SIFC bitmaps are 1 bit per pixel, so grayscale glyphs are
+         * thresholded. */
+        if (!font_mono_bitmap(font, glyph, &bitmap))
+            goto advance;
+
+        count = (bitmap.pitch * bitmap.rows + 3) / 4;
 
         if (!ensure_space(renderer->pushbuf, 12 + count))
             return;
@@ -598,14 +600,14 @@ void renderer_draw_text(struct wld_renderer * base,
         nvc0_2d(renderer->pushbuf, G80_2D_SIFC_WIDTH, 10,
                 /* Use the pitch instead of width to ensure the correct
                  * alignment is used. */
-                glyph->bitmap.pitch * 8, glyph->bitmap.rows,
+                bitmap.pitch * 8, bitmap.rows,
                 0, 1, 0, 1,
                 0, origin_x + glyph->x, 0, y + glyph->y);
         nv_add_dword(renderer->pushbuf,
                      nvc0_command(GF100_COMMAND_TYPE_NON_INCREASING,
                                   GF100_SUBCHANNEL_2D,
                                   G80_2D_SIFC_DATA, count));
-        nv_add_data(renderer->pushbuf, glyph->bitmap.buffer, count);
+        nv_add_data(renderer->pushbuf, bitmap.buffer, count);
 
       advance:
         origin_x += glyph->advance;
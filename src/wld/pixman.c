@@ -24,6 +24,10 @@
 #include "pixman.h"
 #include "wld-private.h"
 
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+
 #define PIXMAN_COLOR(c) {                   \
     .alpha  = ((c >> 24) & 0xff) * 0x101,   \
     .red    = ((c >> 16) & 0xff) * 0x101,   \
@@ -36,6 +40,13 @@ struct pixman_renderer
     struct wld_renderer base;
     pixman_image_t * target;
     pixman_glyph_cache_t * glyph_cache;
+
+    /**
+     * The pixels of the target if fills and glyphs are drawn into it directly,
+     * or NULL. The stride is in pixels.
+     */
+    uint32_t * bits;
+    int32_t width, height, stride;
 };
 
 struct pixman_buffer
@@ -53,6 +64,8 @@ struct pixman_map
 
 #include "interface/context.h"
 #define RENDERER_IMPLEMENTS_REGION
+#define RENDERER_IMPLEMENTS_CELLS
+#define RENDERER_IMPLEMENTS_SCROLL
 #include "interface/renderer.h"
 #include "interface/buffer.h"
 IMPL(pixman_renderer, wld_renderer)
@@ -75,6 +88,7 @@ struct wld_renderer * context_create_renderer(struct wld_context * context)
 
     renderer_initialize(&renderer->base, &wld_renderer_impl);
     renderer->target = NULL;
+    renderer->bits = NULL;
 
     return &renderer->base;
 
@@ -245,6 +259,37 @@ static pixman_image_t * pixman_image(struct buffer * buffer)
     return NULL;
 }
 
+/**
+ * Points the fast paths at the pixels of the new target if it is ARGB8888 or
+ * XRGB8888. Other formats are left to pixman.
+ */
+static void set_target_bits(struct pixman_renderer * renderer)
+{
+    pixman_image_t * image = renderer->target;
+
+    renderer->bits = NULL;
+
+    if (!image)
+        return;
+
+    switch (pixman_image_get_format(image))
+    {
+        case PIXMAN_a8r8g8b8:
+        case PIXMAN_x8r8g8b8:
+            break;
+        default:
+            return;
+    }
+
+    if (pixman_image_get_stride(image) % 4 != 0)
+        return;
+
+    renderer->bits = pixman_image_get_data(image);
+    renderer->width = pixman_image_get_width(image);
+    renderer->height = pixman_image_get_height(image);
+    renderer->stride = pixman_image_get_stride(image) / 4;
+}
+
 bool renderer_set_target(struct wld_renderer * base, struct buffer * buffer)
 {
     struct pixman_renderer * renderer = pixman_renderer(base);
@@ -252,11 +297,239 @@ bool renderer_set_target(struct wld_renderer * base, struct buffer * buffer)
     if (renderer->target)
         pixman_image_unref(renderer->target);
 
-    if (buffer)
-        return (renderer->target = pixman_image(buffer));
+    renderer->target = buffer ? pixman_image(buffer) : NULL;
+    set_target_bits(renderer);
 
-    renderer->target = NULL;
-    return true;
+    return !buffer || renderer->target;
+}
+
+/**** Fast paths ****
+ *
+ * Terminals draw many small fills and glyphs, for which the setup of the
+ * corresponding pixman calls costs more than the pixels themselves. These
+ * kernels draw them straight into 32-bit targets. Like pixman, they treat the
+ * color as premultiplied.
+ */
+
+/* Multiplies each channel of x by a, divided by 255. */
+static inline uint32_t mul_un8x4(uint32_t x, uint32_t a)
+{
+    uint32_t rb = (x & 0xff00ff) * a + 0x800080,
+             ag = ((x >> 8) & 0xff00ff) * a + 0x800080;
+
+    rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+    ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+
+    return rb | ag;
+}
+
+static inline uint32_t over(uint32_t src, uint32_t dst)
+{
+    return src + mul_un8x4(dst, 255 - (src >> 24));
+}
+
+#ifdef __SSE2__
+/* Multiplies 16-bit channels, divided by 255. */
+static inline __m128i mul_un16x8(__m128i x, __m128i a)
+{
+    __m128i t = _mm_adds_epu16(_mm_mullo_epi16(x, a), _mm_set1_epi16(0x80));
+
+    return _mm_mulhi_epu16(t, _mm_set1_epi16(0x101));
+}
+
+/* Expands each pixel's alpha to all of its 16-bit channels. */
+static inline __m128i expand_alpha(__m128i x)
+{
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+}
+#endif
+
+static void fill_row(uint32_t * dst, uint32_t color, int32_t length)
+{
+#ifdef __SSE2__
+    const __m128i src = _mm_set1_epi32(color);
+
+    for (; length >= 4; length -= 4, dst += 4)
+        _mm_storeu_si128((__m128i *) dst, src);
+#endif
+
+    while (length-- > 0)
+        *dst++ = color;
+}
+
+/* Blends color into dst through an 8-bit mask. */
+static void blend_a8_row(uint32_t * dst, const uint8_t * mask,
+                         uint32_t color, int32_t length)
+{
+    const bool opaque = color >> 24 == 0xff;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128(),
+                  inverse = _mm_set1_epi16(0xff),
+                  src = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+    __m128i m, s_lo, s_hi, d, d_lo, d_hi;
+    uint32_t word;
+
+    for (; length >= 4; length -= 4, dst += 4, mask += 4)
+    {
+        memcpy(&word, mask, sizeof word);
+
+        if (word == 0)
+            continue;
+
+        if (word == 0xffffffff && opaque)
+        {
+            _mm_storeu_si128((__m128i *) dst, _mm_set1_epi32(color));
+            continue;
+        }
+
+        /* The mask of each pixel, in all four of its channels. */
+        m = _mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero);
+        m = _mm_unpacklo_epi16(m, m);
+        s_lo = mul_un16x8(src, _mm_unpacklo_epi32(m, m));
+        s_hi = mul_un16x8(src, _mm_unpackhi_epi32(m, m));
+
+        d = _mm_loadu_si128((__m128i *) dst);
+        d_lo = mul_un16x8(_mm_unpacklo_epi8(d, zero),
+                          _mm_xor_si128(expand_alpha(s_lo), inverse));
+        d_hi = mul_un16x8(_mm_unpackhi_epi8(d, zero),
+                          _mm_xor_si128(expand_alpha(s_hi), inverse));
+        d = _mm_packus_epi16(_mm_adds_epu16(s_lo, d_lo),
+                             _mm_adds_epu16(s_hi, d_hi));
+        _mm_storeu_si128((__m128i *) dst, d);
+    }
+#endif
+
+    for (; length > 0; --length, ++dst, ++mask)
+    {
+        if (*mask == 0)
+            continue;
+
+        if (*mask == 0xff && opaque)
+            *dst = color;
+        else
+            *dst = over(mul_un8x4(color, *mask), *dst);
+    }
+}
+
+#ifdef __SSE2__
+/* Expands the 16 bits of the two mask bytes, first bit first, to bytes of
+ * 0xff for the set bits and 0 for the others. */
+static inline __m128i expand_a1(uint8_t byte0, uint8_t byte1)
+{
+    const __m128i bits = _mm_setr_epi8(0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+                                       0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+    __m128i m = _mm_cvtsi32_si128(byte0 | byte1 << 8);
+
+    m = _mm_unpacklo_epi8(m, m);
+    m = _mm_unpacklo_epi16(m, m);
+    m = _mm_unpacklo_epi32(m, m);
+
+    return _mm_cmpeq_epi8(_mm_and_si128(m, bits), bits);
+}
+#endif
+
+/* Blends color into dst through a 1-bit mask, starting at bit first. */
+static void blend_a1_row(uint32_t * dst, const uint8_t * mask, int32_t first,
+                         uint32_t color, int32_t length)
+{
+    const bool opaque = color >> 24 == 0xff;
+
+#ifdef __SSE2__
+    uint8_t bytes[16];
+    int32_t count;
+
+    /* Up to the first byte boundary bit by bit, then 16 pixels at a time
+     * through the 8-bit kernel. */
+    for (; length > 0 && first % 8 != 0; ++first, ++dst, --length)
+    {
+        if (mask[first / 8] & (0x80 >> first % 8))
+            *dst = opaque ? color : over(color, *dst);
+    }
+
+    for (mask += first / 8; length > 0; mask += 2, dst += 16, length -= 16)
+    {
+        count = length < 16 ? length : 16;
+
+        if (mask[0] == 0 && (count <= 8 || mask[1] == 0))
+            continue;
+
+        _mm_storeu_si128((__m128i *) bytes,
+                         expand_a1(mask[0], count > 8 ? mask[1] : 0));
+        blend_a8_row(dst, bytes, color, count);
+    }
+#else
+    int32_t bit;
+
+    for (bit = first; bit < first + length; ++bit, ++dst)
+    {
+        if (!(mask[bit / 8] & (0x80 >> bit % 8)))
+            continue;
+
+        *dst = opaque ? color : over(color, *dst);
+    }
+#endif
+}
+
+static void fast_fill(struct pixman_renderer * renderer, uint32_t color,
+                      int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+    uint32_t * row;
+
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > renderer->width) x2 = renderer->width;
+    if (y2 > renderer->height) y2 = renderer->height;
+
+    if (x1 >= x2)
+        return;
+
+    for (row = renderer->bits + y1 * renderer->stride + x1; y1 < y2;
+         ++y1, row += renderer->stride)
+    {
+        fill_row(row, color, x2 - x1);
+    }
+}
+
+/* Draws a glyph with its origin at x, y. */
+static void fast_glyph(struct pixman_renderer * renderer, uint32_t color,
+                       int32_t x, int32_t y, struct glyph * glyph)
+{
+    const FT_Bitmap * bitmap = &glyph->bitmap;
+    const uint8_t * mask;
+    uint32_t * row;
+    int32_t column, first_row, end_column, end_row;
+
+    x += glyph->x;
+    y += glyph->y;
+    column = x < 0 ? -x : 0;
+    first_row = y < 0 ? -y : 0;
+    end_column = bitmap->width;
+    end_row = bitmap->rows;
+
+    if (x + end_column > renderer->width)
+        end_column = renderer->width - x;
+    if (y + end_row > renderer->height)
+        end_row = renderer->height - y;
+
+    if (column >= end_column)
+        return;
+
+    row = renderer->bits + (y + first_row) * renderer->stride + x + column;
+    mask = bitmap->buffer + first_row * bitmap->pitch;
+
+    for (; first_row < end_row; ++first_row)
+    {
+        if (bitmap->pixel_mode == FT_PIXEL_MODE_GRAY)
+            blend_a8_row(row, mask + column, color, end_column - column);
+        else
+            blend_a1_row(row, mask, column, color, end_column - column);
+
+        row += renderer->stride;
+        mask += bitmap->pitch;
+    }
 }
 
 void renderer_fill_rectangle(struct wld_renderer * base, uint32_t color,
@@ -267,21 +540,45 @@ void renderer_fill_rectangle(struct wld_renderer * base, uint32_t color,
     pixman_color_t pixman_color = PIXMAN_COLOR(color);
     pixman_box32_t box = { x, y, x + width, y + height };
 
-    pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
-                            &pixman_color, 1, &box);
+    if (renderer->bits)
+        fast_fill(renderer, color, box.x1, box.y1, box.x2, box.y2);
+    else
+    {
+        pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
+                                &pixman_color, 1, &box);
+    }
+}
+
+static void fill_boxes(struct pixman_renderer * renderer, uint32_t color,
+                       pixman_box32_t * boxes, uint32_t num_boxes)
+{
+    pixman_color_t pixman_color = PIXMAN_COLOR(color);
+    uint32_t i;
+
+    if (renderer->bits)
+    {
+        for (i = 0; i < num_boxes; ++i)
+        {
+            fast_fill(renderer, color, boxes[i].x1, boxes[i].y1,
+                      boxes[i].x2, boxes[i].y2);
+        }
+    }
+    else if (num_boxes > 0)
+    {
+        pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
+                                &pixman_color, num_boxes, boxes);
+    }
 }
 
 void renderer_fill_region(struct wld_renderer * base, uint32_t color,
                           pixman_region32_t * region)
 {
     struct pixman_renderer * renderer = pixman_renderer(base);
-    pixman_color_t pixman_color = PIXMAN_COLOR(color);
     pixman_box32_t * boxes;
     int num_boxes;
 
     boxes = pixman_region32_rectangles(region, &num_boxes);
-    pixman_image_fill_boxes(PIXMAN_OP_SRC, renderer->target,
-                            &pixman_color, num_boxes, boxes);
+    fill_boxes(renderer, color, boxes, num_boxes);
 }
 
 void renderer_copy_rectangle(struct wld_renderer * base, struct buffer * buffer,
@@ -317,6 +614,51 @@ void renderer_copy_region(struct wld_renderer * base, struct buffer * buffer,
     pixman_image_set_clip_region32(src, NULL);
 }
 
+void renderer_scroll_rectangle(struct wld_renderer * base,
+                               int32_t x, int32_t y,
+                               uint32_t width, uint32_t height, int32_t dy)
+{
+    struct pixman_renderer * renderer = pixman_renderer(base);
+    pixman_image_t * image = renderer->target;
+    uint8_t * src, * dst;
+    int32_t x2 = x + width, y2 = y + height, distance = dy < 0 ? -dy : dy;
+    int stride, bpp, rows;
+
+    if (!image)
+        return;
+
+    bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(image));
+    stride = pixman_image_get_stride(image);
+
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x2 > pixman_image_get_width(image))
+        x2 = pixman_image_get_width(image);
+    if (y2 > pixman_image_get_height(image))
+        y2 = pixman_image_get_height(image);
+
+    if (bpp % 8 != 0 || x >= x2 || distance >= y2 - y)
+        return;
+
+    /* pixman_image_composite32 and pixman_blt make no promises about
+     * overlapping images, so move the rows one at a time, starting from the
+     * side they move towards. */
+    rows = y2 - y - distance;
+    src = (uint8_t *) pixman_image_get_data(image)
+        + (y + (dy < 0 ? distance : 0)) * stride + x * bpp / 8;
+    dst = src + dy * stride;
+
+    if (dy > 0)
+    {
+        src += (rows - 1) * stride;
+        dst += (rows - 1) * stride;
+        stride = -stride;
+    }
+
+    for (; rows > 0; --rows, src += stride, dst += stride)
+        memmove(dst, src, (x2 - x) * bpp / 8);
+}
+
 static inline uint8_t reverse(uint8_t byte)
 {
     byte = ((byte << 1) & 0xaa) | ((byte >> 1) & 0x55);
@@ -326,85 +668,125 @@ static inline uint8_t reverse(uint8_t byte)
     return byte;
 }
 
+/**
+ * Returns the glyph from the glyph cache, inserting it if necessary, or NULL
+ * if it could not be inserted.
+ */
+static const void * cached_glyph(struct pixman_renderer * renderer,
+                                 struct font * font, struct glyph * glyph)
+{
+    const void * cached;
+    uint8_t * src, * dst;
+    uint32_t row, byte_index, bytes_per_row, pitch;
+    pixman_image_t * image;
+    FT_Bitmap * bitmap;
+
+    cached = pixman_glyph_cache_lookup(renderer->glyph_cache, (void *) font->id,
+                                       (void *) (uintptr_t) glyph->index);
+
+    if (cached)
+        return cached;
+
+    /* If we don't have the glyph in our cache, do some conversions to make
+     * pixman happy, and then insert it. */
+    bitmap = &glyph->bitmap;
+    image = pixman_image_create_bits
+        (bitmap->pixel_mode == FT_PIXEL_MODE_GRAY ? PIXMAN_a8 : PIXMAN_a1,
+         bitmap->width, bitmap->rows, NULL, 0);
+
+    if (!image)
+        return NULL;
+
+    pitch = pixman_image_get_stride(image);
+    src = bitmap->buffer;
+    dst = (uint8_t *) pixman_image_get_data(image);
+
+    if (bitmap->pixel_mode == FT_PIXEL_MODE_GRAY)
+    {
+        /* A8 masks only need their rows aligned. */
+        for (row = 0; row < bitmap->rows; ++row)
+        {
+            memcpy(dst, src, bitmap->width);
+            dst += pitch;
+            src += bitmap->pitch;
+        }
+    }
+    else
+    {
+        bytes_per_row = (bitmap->width + 7) / 8;
+
+        for (row = 0; row < bitmap->rows; ++row)
+        {
+            /* Pixman's A1 format expects the bits in the opposite order
+             * that Freetype gives us. Sigh... */
+            for (byte_index = 0; byte_index < bytes_per_row; ++byte_index)
+                dst[byte_index] = reverse(src[byte_index]);
+
+            dst += pitch;
+            src += bitmap->pitch;
+        }
+    }
+
+    /* Insert the glyph into the cache. */
+    pixman_glyph_cache_freeze(renderer->glyph_cache);
+    cached = pixman_glyph_cache_insert
+        (renderer->glyph_cache, (void *) font->id,
+         (void *) (uintptr_t) glyph->index, -glyph->x, -glyph->y, image);
+    pixman_glyph_cache_thaw(renderer->glyph_cache);
+
+    /* The glyph cache copies the contents of the glyph bitmap. */
+    pixman_image_unref(image);
+
+    return cached;
+}
+
 void renderer_draw_text(struct wld_renderer * base,
                         struct font * font, uint32_t color,
-                        int32_t x, int32_t y, const char * text,
-                        uint32_t length, struct wld_extents * extents)
+                        int32_t x, int32_t y, const uint32_t * chars,
+                        uint32_t length, struct wld_extents * extents,
+                        pixman_box32_t * ink)
 {
     struct pixman_renderer * renderer = pixman_renderer(base);
-    int ret;
-    uint32_t c;
     struct glyph * glyph;
-    FT_UInt glyph_index;
-    pixman_glyph_t glyphs[length == -1 ? (length = strlen(text)) : length];
-    uint32_t index = 0, origin_x = 0;
+    pixman_glyph_t glyphs[length];
+    uint32_t i, index = 0, origin_x = 0;
     pixman_color_t pixman_color = PIXMAN_COLOR(color);
     pixman_image_t * solid;
 
+    if (renderer->bits)
+    {
+        for (i = 0; i < length; ++i)
+        {
+            if (!(glyph = font_ensure_char(font, chars[i])))
+                continue;
+
+            fast_glyph(renderer, color, x + origin_x, y, glyph);
+
+            if (ink)
+                glyph_extend_ink(glyph, x + origin_x, y, ink);
+
+            origin_x += glyph->advance;
+        }
+
+        goto done;
+    }
+
     solid = pixman_image_create_solid_fill(&pixman_color);
 
-    while ((ret = FcUtf8ToUcs4((FcChar8 *) text, &c, length)) > 0 && c != '\0')
+    for (i = 0; i < length; ++i)
     {
-        text += ret;
-        length -= ret;
-        glyph_index = FT_Get_Char_Index(font->face, c);
-
-        if (!font_ensure_glyph(font, glyph_index))
+        if (!(glyph = font_ensure_char(font, chars[i])))
             continue;
 
-        glyph = font->glyphs[glyph_index];
-
         glyphs[index].x = origin_x;
         glyphs[index].y = 0;
-        glyphs[index].glyph = pixman_glyph_cache_lookup(renderer->glyph_cache,
-                                                        font, glyph);
 
-        /* If we don't have the glyph in our cache, do some conversions to make
-         * pixman happy, and then insert it. */
-        if (!glyphs[index].glyph)
-        {
-            uint8_t * src, * dst;
-            uint32_t row, byte_index, bytes_per_row, pitch;
-            pixman_image_t * image;
-            FT_Bitmap * bitmap;
-
-            bitmap = &glyph->bitmap;
-            image = pixman_image_create_bits
-                (PIXMAN_a1, bitmap->width, bitmap->rows, NULL, bitmap->pitch);
-
-            if (!image)
-                goto advance;
-
-            pitch = pixman_image_get_stride(image);
-            bytes_per_row = (bitmap->width + 7) / 8;
-            src = bitmap->buffer;
-            dst = (uint8_t *) pixman_image_get_data(image);
-
-            for (row = 0; row < bitmap->rows; ++row)
-            {
-                /* Pixman's A1 format expects the bits in the opposite order
-                 * that Freetype gives us. Sigh... */
-                for (byte_index = 0; byte_index < bytes_per_row; ++byte_index)
-                    dst[byte_index] = reverse(src[byte_index]);
-
-                dst += pitch;
-                src += bitmap->pitch;
-            }
-
-            /* Insert the glyph into the cache. */
-            pixman_glyph_cache_freeze(renderer->glyph_cache);
-            glyphs[index].glyph = pixman_glyph_cache_insert
-                (renderer->glyph_cache, font, glyph,
-                 -glyph->x, -glyph->y, image);
-            pixman_glyph_cache_thaw(renderer->glyph_cache);
-
-            /* The glyph cache copies the contents of the glyph bitmap. */
-            pixman_image_unref(image);
-        }
+        if ((glyphs[index].glyph = cached_glyph(renderer, font, glyph)))
+            ++index;
 
-        ++index;
+        if (ink)
+            glyph_extend_ink(glyph, x + origin_x, y, ink);
 
-      advance:
         origin_x += glyph->advance;
     }
 
@@ -414,10 +796,155 @@ void renderer_draw_text(struct wld_renderer * base,
 
     pixman_image_unref(solid);
 
+  done:
     if (extents)
         extents->advance = origin_x;
 }
 
+void renderer_draw_cells(struct wld_renderer * base, int32_t x, int32_t y,
+                         const struct wld_cell * cells, uint32_t length,
+                         const struct wld_cell_layout * layout,
+                         pixman_box32_t * ink)
+{
+    struct pixman_renderer * renderer = pixman_renderer(base);
+    pixman_box32_t boxes[2 * length + 1];
+    pixman_glyph_t glyphs[length + 1];
+    pixman_color_t pixman_color;
+    pixman_image_t * solid;
+    struct font * font;
+    struct glyph * glyph;
+    uint32_t i, start, num_boxes, num_glyphs, color = 0;
+
+    /* Backgrounds, one box per run of cells with the same color and one fill
+     * per color change. */
+    for (num_boxes = 0, i = 0; i < length; i = start)
+    {
+        start = i + 1;
+
+        while (start < length && cells[start].bg == cells[i].bg
+               && cells[start].flags == cells[i].flags)
+        {
+            ++start;
+        }
+
+        if (cells[i].flags & WLD_CELL_NO_BACKGROUND)
+            continue;
+
+        if (num_boxes > 0 && cells[i].bg != color)
+        {
+            fill_boxes(renderer, color, boxes, num_boxes);
+            num_boxes = 0;
+        }
+
+        color = cells[i].bg;
+        boxes[num_boxes++] = (pixman_box32_t) {
+            x + i * layout->width, y,
+            x + start * layout->width, y + layout->height
+        };
+    }
+
+    if (num_boxes > 0)
+        fill_boxes(renderer, color, boxes, num_boxes);
+
+    /* Glyphs, drawn directly if the target allows it, or else composited
+     * straight from the glyph cache, whatever their font, in one call per run
+     * of cells with the same color. */
+    for (i = 0; renderer->bits && i < length; ++i)
+    {
+        if (!cells[i].character || cells[i].font >= layout->num_fonts)
+            continue;
+
+        font = (void *) layout->fonts[cells[i].font];
+
+        if (!(glyph = font_ensure_char(font, cells[i].character)))
+            continue;
+
+        fast_glyph(renderer, cells[i].fg, x + i * layout->width,
+                   y + font->base.ascent, glyph);
+
+        if (ink)
+        {
+            glyph_extend_ink(glyph, x + i * layout->width,
+                             y + font->base.ascent, ink);
+        }
+    }
+
+    for (num_glyphs = 0, i = 0; !renderer->bits && i <= length; ++i)
+    {
+        if (num_glyphs > 0 && (i == length || (cells[i].character
+                                               && cells[i].fg != color)))
+        {
+            pixman_color = (pixman_color_t) PIXMAN_COLOR(color);
+            solid = pixman_image_create_solid_fill(&pixman_color);
+            pixman_composite_glyphs_no_mask
+                (PIXMAN_OP_OVER, solid, renderer->target, 0, 0, x, y,
+                 renderer->glyph_cache, num_glyphs, glyphs);
+            pixman_image_unref(solid);
+            num_glyphs = 0;
+        }
+
+        if (i == length || !cells[i].character
+            || cells[i].font >= layout->num_fonts)
+        {
+            continue;
+        }
+
+        font = (void *) layout->fonts[cells[i].font];
+
+        if (!(glyph = font_ensure_char(font, cells[i].character)))
+            continue;
+
+        glyphs[num_glyphs].x = i * layout->width;
+        glyphs[num_glyphs].y = font->base.ascent;
+
+        if ((glyphs[num_glyphs].glyph = cached_glyph(renderer, font, glyph)))
+        {
+            color = cells[i].fg;
+            ++num_glyphs;
+        }
+
+        if (ink)
+        {
+            glyph_extend_ink(glyph, x + i * layout->width,
+                             y + font->base.ascent, ink);
+        }
+    }
+
+    /* Underlines and strike lines. */
+    for (num_boxes = 0, i = 0; i < length; ++i)
+    {
+        if (!(cells[i].flags & (WLD_CELL_UNDERLINE | WLD_CELL_STRUCK)))
+            continue;
+
+        if (num_boxes > 0 && cells[i].fg != color)
+        {
+            fill_boxes(renderer, color, boxes, num_boxes);
+            num_boxes = 0;
+        }
+
+        color = cells[i].fg;
+
+        if (cells[i].flags & WLD_CELL_UNDERLINE)
+        {
+            boxes[num_boxes++] = (pixman_box32_t) {
+                x + i * layout->width, y + layout->underline,
+                x + (i + 1) * layout->width, y + layout->underline + 1
+            };
+        }
+
+        if (cells[i].flags & WLD_CELL_STRUCK)
+        {
+            boxes[num_boxes++] = (pixman_box32_t) {
+                x + i * layout->width, y + layout->strike,
+                x + (i + 1) * layout->width, y + layout->strike + 1
+            };
+        }
+    }
+
+    if (num_boxes > 0)
+        fill_boxes(renderer, color, boxes, num_boxes);
+}
+
 void renderer_flush(struct wld_renderer * renderer)
 {
 }
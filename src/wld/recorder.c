@@ -0,0 +1,657 @@
+/* wld: recorder.c
+ *
+ * Copyright (c) 2013, 2014 Michael Forney
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "wld-private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum op_type
+{
+    OP_SET_TARGET,
+    OP_FILL_RECTANGLE,
+    OP_FILL_REGION,
+    OP_COPY_RECTANGLE,
+    OP_COPY_REGION,
+    OP_SCROLL_RECTANGLE,
+    OP_DRAW_TEXT,
+    OP_DRAW_CELLS
+};
+
+struct op
+{
+    enum op_type type;
+
+    union
+    {
+        struct buffer * target;
+        struct
+        {
+            uint32_t color;
+            int32_t x, y;
+            uint32_t width, height;
+        } fill;
+        struct
+        {
+            struct buffer * src;
+            int32_t dst_x, dst_y, src_x, src_y;
+            uint32_t width, height;
+        } copy;
+        struct
+        {
+            int32_t x, y;
+            uint32_t width, height;
+            int32_t dy;
+        } scroll;
+        struct
+        {
+            struct font * font;
+            uint32_t color;
+            int32_t x, y;
+            uint32_t length;
+        } text;
+        struct
+        {
+            int32_t x, y;
+            uint32_t length;
+            struct wld_cell_layout layout;
+        } cells;
+    } u;
+
+    /**
+     * The offset of the data of the operation, such as characters or boxes, in
+     * the data of the list, and the number of items (for regions, boxes).
+     */
+    size_t data;
+    uint32_t count;
+};
+
+struct wld_display_list
+{
+    struct op * ops;
+    uint32_t num_ops, ops_capacity;
+
+    uint8_t * data;
+    size_t data_size, data_capacity;
+};
+
+struct recording_renderer
+{
+    struct wld_renderer base;
+
+    /* The renderer the recorded operations are replayed with on flush. */
+    struct wld_renderer * renderer;
+
+    struct wld_display_list * list;
+
+    /* The number of operations of the list already replayed. */
+    uint32_t replayed;
+};
+
+#define RENDERER_IMPLEMENTS_REGION
+#define RENDERER_IMPLEMENTS_CELLS
+#define RENDERER_IMPLEMENTS_SCROLL
+#include "interface/renderer.h"
+IMPL(recording_renderer, wld_renderer)
+
+static struct wld_display_list * display_list_create()
+{
+    struct wld_display_list * list;
+
+    if (!(list = malloc(sizeof *list)))
+        return NULL;
+
+    list->ops = NULL;
+    list->num_ops = list->ops_capacity = 0;
+    list->data = NULL;
+    list->data_size = list->data_capacity = 0;
+
+    return list;
+}
+
+/**
+ * Adds an operation to the display list, with room for size bytes of data,
+ * returning it or NULL if there was not enough memory.
+ */
+static struct op * add_op(struct wld_display_list * list, enum op_type type,
+                          size_t size)
+{
+    struct op * op;
+
+    if (list->num_ops == list->ops_capacity)
+    {
+        uint32_t capacity = list->ops_capacity ? list->ops_capacity * 2 : 64;
+        struct op * ops;
+
+        if (!(ops = realloc(list->ops, capacity * sizeof *ops)))
+            return NULL;
+
+        list->ops = ops;
+        list->ops_capacity = capacity;
+    }
+
+    size = (size + 7) & ~(size_t) 7;
+
+    if (list->data_size + size > list->data_capacity)
+    {
+        size_t capacity = list->data_capacity ? list->data_capacity : 4096;
+        uint8_t * data;
+
+        while (capacity < list->data_size + size)
+            capacity *= 2;
+
+        if (!(data = realloc(list->data, capacity)))
+            return NULL;
+
+        list->data = data;
+        list->data_capacity = capacity;
+    }
+
+    op = &list->ops[list->num_ops++];
+    op->type = type;
+    op->data = list->data_size;
+    op->count = 0;
+    list->data_size += size;
+
+    return op;
+}
+
+static inline void * op_data(struct wld_display_list * list, struct op * op)
+{
+    return list->data + op->data;
+}
+
+/* The fonts of a draw_cells operation follow its cells. */
+static inline struct wld_font ** cells_fonts(struct wld_display_list * list,
+                                             struct op * op)
+{
+    size_t cells_size = op->u.cells.length * sizeof (struct wld_cell);
+
+    return (void *) (list->data + op->data + ((cells_size + 7) & ~(size_t) 7));
+}
+
+static void add_region(struct wld_display_list * list, enum op_type type,
+                       pixman_region32_t * region, struct op ** op)
+{
+    pixman_box32_t * boxes;
+    int num_boxes;
+
+    boxes = pixman_region32_rectangles(region, &num_boxes);
+
+    if (!(*op = add_op(list, type, num_boxes * sizeof *boxes)))
+        return;
+
+    memcpy(op_data(list, *op), boxes, num_boxes * sizeof *boxes);
+    (*op)->count = num_boxes;
+}
+
+EXPORT
+struct wld_renderer * wld_create_recorder(struct wld_renderer * renderer)
+{
+    struct recording_renderer * recorder;
+
+    if (!(recorder = malloc(sizeof *recorder)))
+        goto error0;
+
+    if (!(recorder->list = display_list_create()))
+        goto error1;
+
+    renderer_initialize(&recorder->base, &wld_renderer_impl);
+    recorder->renderer = renderer;
+    recorder->replayed = 0;
+
+    return &recorder->base;
+
+  error1:
+    free(recorder);
+  error0:
+    return NULL;
+}
+
+EXPORT
+struct wld_display_list * wld_recorder_take(struct wld_renderer * base)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct wld_display_list * list, * empty;
+
+    if (!(empty = display_list_create()))
+        return NULL;
+
+    list = recorder->list;
+    recorder->list = empty;
+    recorder->replayed = 0;
+
+    return list;
+}
+
+static void replay(struct wld_renderer * renderer,
+                   struct wld_display_list * list,
+                   uint32_t first, uint32_t last)
+{
+    struct op * op;
+    pixman_region32_t region;
+
+    for (op = &list->ops[first]; op < &list->ops[last]; ++op)
+    {
+        switch (op->type)
+        {
+            case OP_SET_TARGET:
+                wld_set_target_buffer(renderer, &op->u.target->base);
+                break;
+            case OP_FILL_RECTANGLE:
+                renderer->impl->fill_rectangle
+                    (renderer, op->u.fill.color, op->u.fill.x, op->u.fill.y,
+                     op->u.fill.width, op->u.fill.height);
+                break;
+            case OP_FILL_REGION:
+                pixman_region32_init_rects(&region, op_data(list, op),
+                                           op->count);
+                renderer->impl->fill_region(renderer, op->u.fill.color,
+                                            &region);
+                pixman_region32_fini(&region);
+                break;
+            case OP_COPY_RECTANGLE:
+                renderer->impl->copy_rectangle
+                    (renderer, op->u.copy.src,
+                     op->u.copy.dst_x, op->u.copy.dst_y,
+                     op->u.copy.src_x, op->u.copy.src_y,
+                     op->u.copy.width, op->u.copy.height);
+                break;
+            case OP_COPY_REGION:
+                pixman_region32_init_rects(&region, op_data(list, op),
+                                           op->count);
+                renderer->impl->copy_region(renderer, op->u.copy.src,
+                                            op->u.copy.dst_x, op->u.copy.dst_y,
+                                            &region);
+                pixman_region32_fini(&region);
+                break;
+            case OP_SCROLL_RECTANGLE:
+                renderer->impl->scroll_rectangle
+                    (renderer, op->u.scroll.x, op->u.scroll.y,
+                     op->u.scroll.width, op->u.scroll.height,
+                     op->u.scroll.dy);
+                break;
+            case OP_DRAW_TEXT:
+                renderer->impl->draw_text
+                    (renderer, op->u.text.font, op->u.text.color,
+                     op->u.text.x, op->u.text.y, op_data(list, op),
+                     op->u.text.length, NULL, NULL);
+                break;
+            case OP_DRAW_CELLS:
+            {
+                struct wld_cell_layout layout = op->u.cells.layout;
+
+                layout.fonts = cells_fonts(list, op);
+                renderer->impl->draw_cells(renderer,
+                                           op->u.cells.x, op->u.cells.y,
+                                           op_data(list, op),
+                                           op->u.cells.length, &layout,
+                                           NULL);
+                break;
+            }
+        }
+    }
+}
+
+EXPORT
+void wld_replay(struct wld_renderer * renderer, struct wld_display_list * list)
+{
+    replay(renderer, list, 0, list->num_ops);
+}
+
+EXPORT
+void wld_display_list_dump(struct wld_display_list * list, FILE * file)
+{
+    struct op * op;
+    pixman_box32_t * box;
+    const uint32_t * chars;
+    const struct wld_cell * cells;
+    FcChar8 utf8[FC_UTF8_MAX_LEN + 1];
+    uint32_t i;
+    int length;
+
+    for (op = list->ops; op < &list->ops[list->num_ops]; ++op)
+    {
+        switch (op->type)
+        {
+            case OP_SET_TARGET:
+                fprintf(file, "set_target %p %ux%u\n",
+                        (void *) op->u.target,
+                        op->u.target->base.width, op->u.target->base.height);
+                break;
+            case OP_FILL_RECTANGLE:
+                fprintf(file, "fill_rectangle #%08x %d,%d %ux%u\n",
+                        op->u.fill.color, op->u.fill.x, op->u.fill.y,
+                        op->u.fill.width, op->u.fill.height);
+                break;
+            case OP_FILL_REGION:
+            case OP_COPY_REGION:
+                if (op->type == OP_FILL_REGION)
+                    fprintf(file, "fill_region #%08x", op->u.fill.color);
+                else
+                {
+                    fprintf(file, "copy_region %p %d,%d",
+                            (void *) op->u.copy.src,
+                            op->u.copy.dst_x, op->u.copy.dst_y);
+                }
+
+                box = op_data(list, op);
+
+                for (i = 0; i < op->count; ++i, ++box)
+                {
+                    fprintf(file, " %d,%d %dx%d", box->x1, box->y1,
+                            box->x2 - box->x1, box->y2 - box->y1);
+                }
+
+                fputc('\n', file);
+                break;
+            case OP_COPY_RECTANGLE:
+                fprintf(file, "copy_rectangle %p %d,%d %d,%d %ux%u\n",
+                        (void *) op->u.copy.src,
+                        op->u.copy.dst_x, op->u.copy.dst_y,
+                        op->u.copy.src_x, op->u.copy.src_y,
+                        op->u.copy.width, op->u.copy.height);
+                break;
+            case OP_SCROLL_RECTANGLE:
+                fprintf(file, "scroll_rectangle %d,%d %ux%u %+d\n",
+                        op->u.scroll.x, op->u.scroll.y,
+                        op->u.scroll.width, op->u.scroll.height,
+                        op->u.scroll.dy);
+                break;
+            case OP_DRAW_TEXT:
+                fprintf(file, "draw_text %lu #%08x %d,%d \"",
+                        (unsigned long) op->u.text.font->id,
+                        op->u.text.color, op->u.text.x, op->u.text.y);
+                chars = op_data(list, op);
+
+                for (i = 0; i < op->u.text.length; ++i)
+                {
+                    length = FcUcs4ToUtf8(chars[i], utf8);
+                    fwrite(utf8, 1, length, file);
+                }
+
+                fputs("\"\n", file);
+                break;
+            case OP_DRAW_CELLS:
+                fprintf(file, "draw_cells %d,%d %ux%u %u cells:",
+                        op->u.cells.x, op->u.cells.y,
+                        op->u.cells.layout.width, op->u.cells.layout.height,
+                        op->u.cells.length);
+                cells = op_data(list, op);
+
+                for (i = 0; i < op->u.cells.length; ++i)
+                {
+                    fprintf(file, " U+%04X/%u/#%08x/#%08x/%x",
+                            cells[i].character, cells[i].font,
+                            cells[i].fg, cells[i].bg, cells[i].flags);
+                }
+
+                fputc('\n', file);
+                break;
+        }
+    }
+}
+
+EXPORT
+void wld_destroy_display_list(struct wld_display_list * list)
+{
+    struct op * op;
+
+    for (op = list->ops; op < &list->ops[list->num_ops]; ++op)
+    {
+        switch (op->type)
+        {
+            case OP_SET_TARGET:
+                wld_buffer_unreference(&op->u.target->base);
+                break;
+            case OP_COPY_RECTANGLE:
+            case OP_COPY_REGION:
+                wld_buffer_unreference(&op->u.copy.src->base);
+                break;
+            default:
+                break;
+        }
+    }
+
+    free(list->ops);
+    free(list->data);
+    free(list);
+}
+
+uint32_t renderer_capabilities(struct wld_renderer * base,
+                               struct buffer * buffer)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+
+    if (recorder->renderer)
+        return recorder->renderer->impl->capabilities(recorder->renderer,
+                                                      buffer);
+
+    return WLD_CAPABILITY_READ | WLD_CAPABILITY_WRITE;
+}
+
+bool renderer_set_target(struct wld_renderer * base, struct buffer * buffer)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct op * op;
+
+    /* wld_flush resets the target, which replaying does itself. */
+    if (!buffer)
+        return true;
+
+    if (!(op = add_op(recorder->list, OP_SET_TARGET, 0)))
+        return false;
+
+    wld_buffer_reference(&buffer->base);
+    op->u.target = buffer;
+
+    return true;
+}
+
+void renderer_fill_rectangle(struct wld_renderer * base, uint32_t color,
+                             int32_t x, int32_t y,
+                             uint32_t width, uint32_t height)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct op * op;
+
+    if (!(op = add_op(recorder->list, OP_FILL_RECTANGLE, 0)))
+        return;
+
+    op->u.fill.color = color;
+    op->u.fill.x = x;
+    op->u.fill.y = y;
+    op->u.fill.width = width;
+    op->u.fill.height = height;
+}
+
+void renderer_fill_region(struct wld_renderer * base, uint32_t color,
+                          pixman_region32_t * region)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct op * op;
+
+    add_region(recorder->list, OP_FILL_REGION, region, &op);
+
+    if (op)
+        op->u.fill.color = color;
+}
+
+void renderer_copy_rectangle(struct wld_renderer * base,
+                             struct buffer * buffer,
+                             int32_t dst_x, int32_t dst_y,
+                             int32_t src_x, int32_t src_y,
+                             uint32_t width, uint32_t height)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct op * op;
+
+    if (!(op = add_op(recorder->list, OP_COPY_RECTANGLE, 0)))
+        return;
+
+    wld_buffer_reference(&buffer->base);
+    op->u.copy.src = buffer;
+    op->u.copy.dst_x = dst_x;
+    op->u.copy.dst_y = dst_y;
+    op->u.copy.src_x = src_x;
+    op->u.copy.src_y = src_y;
+    op->u.copy.width = width;
+    op->u.copy.height = height;
+}
+
+void renderer_copy_region(struct wld_renderer * base, struct buffer * buffer,
+                          int32_t dst_x, int32_t dst_y,
+                          pixman_region32_t * region)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct op * op;
+
+    add_region(recorder->list, OP_COPY_REGION, region, &op);
+
+    if (!op)
+        return;
+
+    wld_buffer_reference(&buffer->base);
+    op->u.copy.src = buffer;
+    op->u.copy.dst_x = dst_x;
+    op->u.copy.dst_y = dst_y;
+}
+
+void renderer_scroll_rectangle(struct wld_renderer * base,
+                               int32_t x, int32_t y,
+                               uint32_t width, uint32_t height, int32_t dy)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct op * op;
+
+    if (!(op = add_op(recorder->list, OP_SCROLL_RECTANGLE, 0)))
+        return;
+
+    op->u.scroll.x = x;
+    op->u.scroll.y = y;
+    op->u.scroll.width = width;
+    op->u.scroll.height = height;
+    op->u.scroll.dy = dy;
+}
+
+void renderer_draw_text(struct wld_renderer * base,
+                        struct font * font, uint32_t color,
+                        int32_t x, int32_t y, const uint32_t * chars,
+                        uint32_t length, struct wld_extents * extents,
+                        pixman_box32_t * ink)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    struct glyph * glyph;
+    struct op * op;
+    uint32_t i, advance = 0;
+
+    if ((op = add_op(recorder->list, OP_DRAW_TEXT, length * sizeof *chars)))
+    {
+        memcpy(op_data(recorder->list, op), chars, length * sizeof *chars);
+        op->u.text.font = font;
+        op->u.text.color = color;
+        op->u.text.x = x;
+        op->u.text.y = y;
+        op->u.text.length = length;
+    }
+
+    /* Nothing is drawn yet, but the glyphs are known. */
+    for (i = 0; (extents || ink) && i < length; ++i)
+    {
+        if (!(glyph = font_ensure_char(font, chars[i])))
+            continue;
+
+        if (ink)
+            glyph_extend_ink(glyph, x + advance, y, ink);
+
+        advance += glyph->advance;
+    }
+
+    if (extents)
+        extents->advance = advance;
+}
+
+void renderer_draw_cells(struct wld_renderer * base, int32_t x, int32_t y,
+                         const struct wld_cell * cells, uint32_t length,
+                         const struct wld_cell_layout * layout,
+                         pixman_box32_t * ink)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+    size_t cells_size = (length * sizeof *cells + 7) & ~(size_t) 7;
+    struct font * font;
+    struct glyph * glyph;
+    struct op * op;
+    uint32_t i;
+
+    for (i = 0; ink && i < length; ++i)
+    {
+        if (!cells[i].character || cells[i].font >= layout->num_fonts)
+            continue;
+
+        font = (void *) layout->fonts[cells[i].font];
+
+        if ((glyph = font_ensure_char(font, cells[i].character)))
+        {
+            glyph_extend_ink(glyph, x + i * layout->width,
+                             y + font->base.ascent, ink);
+        }
+    }
+
+    op = add_op(recorder->list, OP_DRAW_CELLS,
+                cells_size + layout->num_fonts * sizeof *layout->fonts);
+
+    if (!op)
+        return;
+
+    op->u.cells.x = x;
+    op->u.cells.y = y;
+    op->u.cells.length = length;
+    memcpy(op_data(recorder->list, op), cells, length * sizeof *cells);
+    memcpy(cells_fonts(recorder->list, op), layout->fonts,
+           layout->num_fonts * sizeof *layout->fonts);
+    op->u.cells.layout = *layout;
+    op->u.cells.layout.fonts = NULL;
+}
+
+void renderer_flush(struct wld_renderer * base)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+
+    if (!recorder->renderer)
+        return;
+
+    replay(recorder->renderer, recorder->list,
+           recorder->replayed, recorder->list->num_ops);
+    recorder->replayed = recorder->list->num_ops;
+    wld_flush(recorder->renderer);
+}
+
+void renderer_destroy(struct wld_renderer * base)
+{
+    struct recording_renderer * recorder = recording_renderer(base);
+
+    wld_destroy_display_list(recorder->list);
+    free(recorder);
+}
+
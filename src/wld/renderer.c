@@ -23,6 +23,8 @@
 
 #include "wld-private.h"
 
+#include <string.h>
+
 void default_fill_region(struct wld_renderer * renderer, uint32_t color,
                          pixman_region32_t * region)
 {
@@ -39,6 +41,76 @@ void default_fill_region(struct wld_renderer * renderer, uint32_t color,
     }
 }
 
+void default_draw_cells(struct wld_renderer * renderer, int32_t x, int32_t y,
+                        const struct wld_cell * cells, uint32_t length,
+                        const struct wld_cell_layout * layout,
+                        pixman_box32_t * ink)
+{
+    struct font * font;
+    uint32_t i, start, flag;
+    static const uint8_t line_flags[] = {
+        WLD_CELL_UNDERLINE, WLD_CELL_STRUCK
+    };
+
+    /* Backgrounds, one rectangle per run of cells with the same color. */
+    for (start = 0, i = 1; i <= length; ++i)
+    {
+        if (i < length && cells[i].bg == cells[start].bg
+            && !((cells[i].flags ^ cells[start].flags)
+                 & WLD_CELL_NO_BACKGROUND))
+        {
+            continue;
+        }
+
+        if (!(cells[start].flags & WLD_CELL_NO_BACKGROUND))
+        {
+            renderer->impl->fill_rectangle
+                (renderer, cells[start].bg, x + start * layout->width, y,
+                 (i - start) * layout->width, layout->height);
+        }
+
+        start = i;
+    }
+
+    for (i = 0; i < length; ++i)
+    {
+        if (!cells[i].character || cells[i].font >= layout->num_fonts)
+            continue;
+
+        font = (void *) layout->fonts[cells[i].font];
+        renderer->impl->draw_text(renderer, font, cells[i].fg,
+                                  x + i * layout->width,
+                                  y + font->base.ascent,
+                                  &cells[i].character, 1, NULL, ink);
+    }
+
+    /* Lines, one rectangle per run of cells with the same color. */
+    for (flag = 0; flag < ARRAY_LENGTH(line_flags); ++flag)
+    {
+        int32_t offset = line_flags[flag] == WLD_CELL_UNDERLINE
+                       ? layout->underline : layout->strike;
+
+        for (start = 0, i = 0; i <= length; ++i)
+        {
+            if (i < length && cells[i].flags & line_flags[flag]
+                && (i == start || cells[i].fg == cells[start].fg))
+            {
+                continue;
+            }
+
+            if (i > start)
+            {
+                renderer->impl->fill_rectangle
+                    (renderer, cells[start].fg, x + start * layout->width,
+                     y + offset, (i - start) * layout->width, 1);
+            }
+
+            start = i < length && cells[i].flags & line_flags[flag]
+                  ? i : i + 1;
+        }
+    }
+}
+
 void default_copy_region(struct wld_renderer * renderer, struct buffer * buffer,
                          int32_t dst_x, int32_t dst_y,
                          pixman_region32_t * region)
@@ -58,11 +130,77 @@ void default_copy_region(struct wld_renderer * renderer, struct buffer * buffer,
     }
 }
 
+void default_scroll_rectangle(struct wld_renderer * renderer,
+                              int32_t x, int32_t y,
+                              uint32_t width, uint32_t height, int32_t dy)
+{
+    struct buffer * target = (void *) renderer->target;
+    uint32_t distance = dy < 0 ? -dy : dy, rows, done, band, offset;
+
+    if (!target || dy == 0 || distance >= height)
+        return;
+
+    rows = height - distance;
+
+    /* Each band is no taller than the distance moved, so it does not overlap
+     * its destination, and the bands are copied starting from the side the
+     * rows move towards, so none is overwritten before it is copied. */
+    for (done = 0; done < rows; done += band)
+    {
+        band = rows - done < distance ? rows - done : distance;
+        offset = dy < 0 ? done : rows - done - band;
+        renderer->impl->copy_rectangle
+            (renderer, target, x, y + offset + (dy < 0 ? 0 : distance),
+             x, y + offset + (dy < 0 ? distance : 0), width, band);
+    }
+}
+
 void renderer_initialize(struct wld_renderer * renderer,
                          const struct wld_renderer_impl * impl)
 {
     *((const struct wld_renderer_impl **) &renderer->impl) = impl;
     renderer->target = NULL;
+    renderer->track_damage = false;
+}
+
+/**** Damage tracking ****/
+
+static inline bool tracks_damage(struct wld_renderer * renderer)
+{
+    return renderer->track_damage && renderer->target;
+}
+
+static void add_damage(struct wld_renderer * renderer,
+                       int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+    struct wld_buffer * target = renderer->target;
+
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > (int32_t) target->width) x2 = target->width;
+    if (y2 > (int32_t) target->height) y2 = target->height;
+
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    pixman_region32_union_rect(&target->damage, &target->damage,
+                               x1, y1, x2 - x1, y2 - y1);
+}
+
+static void add_damage_region(struct wld_renderer * renderer,
+                              pixman_region32_t * region,
+                              int32_t dx, int32_t dy)
+{
+    struct wld_buffer * target = renderer->target;
+    pixman_region32_t damage;
+
+    pixman_region32_init(&damage);
+    pixman_region32_copy(&damage, region);
+    pixman_region32_translate(&damage, dx, dy);
+    pixman_region32_intersect_rect(&damage, &damage, 0, 0,
+                                   target->width, target->height);
+    pixman_region32_union(&target->damage, &target->damage, &damage);
+    pixman_region32_fini(&damage);
 }
 
 EXPORT
@@ -99,7 +237,12 @@ bool wld_set_target_surface(struct wld_renderer * renderer,
     if (!(back_buffer = surface->impl->back(surface)))
         return false;
 
-    return renderer->impl->set_target(renderer, back_buffer);
+    if (!renderer->impl->set_target(renderer, back_buffer))
+        return false;
+
+    renderer->target = &back_buffer->base;
+
+    return true;
 }
 
 EXPORT
@@ -107,6 +250,9 @@ void wld_fill_rectangle(struct wld_renderer * renderer, uint32_t color,
                         int32_t x, int32_t y, uint32_t width, uint32_t height)
 {
     renderer->impl->fill_rectangle(renderer, color, x, y, width, height);
+
+    if (tracks_damage(renderer))
+        add_damage(renderer, x, y, x + width, y + height);
 }
 
 EXPORT
@@ -114,6 +260,9 @@ void wld_fill_region(struct wld_renderer * renderer, uint32_t color,
                      pixman_region32_t * region)
 {
     renderer->impl->fill_region(renderer, color, region);
+
+    if (tracks_damage(renderer))
+        add_damage_region(renderer, region, 0, 0);
 }
 
 EXPORT
@@ -125,6 +274,9 @@ void wld_copy_rectangle(struct wld_renderer * renderer,
 {
     renderer->impl->copy_rectangle(renderer, (struct buffer *) buffer,
                                    dst_x, dst_y, src_x, src_y, width, height);
+
+    if (tracks_damage(renderer))
+        add_damage(renderer, dst_x, dst_y, dst_x + width, dst_y + height);
 }
 
 EXPORT
@@ -134,6 +286,36 @@ void wld_copy_region(struct wld_renderer * renderer,
 {
     renderer->impl->copy_region(renderer, (struct buffer *) buffer,
                                 dst_x, dst_y, region);
+
+    if (tracks_damage(renderer))
+        add_damage_region(renderer, region, dst_x, dst_y);
+}
+
+EXPORT
+void wld_scroll_rectangle(struct wld_renderer * renderer,
+                          int32_t x, int32_t y, uint32_t width, uint32_t height,
+                          int32_t dy)
+{
+    struct wld_buffer * target = renderer->target;
+    int32_t x2 = x + width, y2 = y + height;
+
+    if (target)
+    {
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+        if (x2 > (int32_t) target->width) x2 = target->width;
+        if (y2 > (int32_t) target->height) y2 = target->height;
+    }
+
+    /* Nothing moves. */
+    if (dy == 0 || x >= x2 || (dy < 0 ? -dy : dy) >= y2 - y)
+        return;
+
+    renderer->impl->scroll_rectangle(renderer, x, y, x2 - x, y2 - y, dy);
+
+    /* Only the rows moved into are written. */
+    if (tracks_damage(renderer))
+        add_damage(renderer, x, dy > 0 ? y + dy : y, x2, dy < 0 ? y2 + dy : y2);
 }
 
 EXPORT
@@ -143,9 +325,56 @@ void wld_draw_text(struct wld_renderer * renderer,
                    struct wld_extents * extents)
 {
     struct font * font = (void *) font_base;
+    uint32_t chars[length == -1 ? (length = strlen(text)) : length];
+    uint32_t c, count = 0;
+    pixman_box32_t ink = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+    int ret;
+
+    while ((ret = FcUtf8ToUcs4((FcChar8 *) text, &c, length)) > 0 && c != '\0')
+    {
+        text += ret;
+        length -= ret;
+        chars[count++] = c;
+    }
+
+    renderer->impl->draw_text(renderer, font, color, x, y, chars, count,
+                              extents, tracks_damage(renderer) ? &ink : NULL);
 
-    renderer->impl->draw_text(renderer, font, color, x, y, text, length,
-                              extents);
+    if (tracks_damage(renderer))
+        add_damage(renderer, ink.x1, ink.y1, ink.x2, ink.y2);
+}
+
+EXPORT
+void wld_draw_chars(struct wld_renderer * renderer,
+                    struct wld_font * font_base, uint32_t color,
+                    int32_t x, int32_t y, const uint32_t * chars,
+                    uint32_t length, struct wld_extents * extents)
+{
+    struct font * font = (void *) font_base;
+    pixman_box32_t ink = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+
+    renderer->impl->draw_text(renderer, font, color, x, y, chars, length,
+                              extents, tracks_damage(renderer) ? &ink : NULL);
+
+    if (tracks_damage(renderer))
+        add_damage(renderer, ink.x1, ink.y1, ink.x2, ink.y2);
+}
+
+EXPORT
+void wld_draw_cells(struct wld_renderer * renderer, int32_t x, int32_t y,
+                    const struct wld_cell * cells, uint32_t length,
+                    const struct wld_cell_layout * layout)
+{
+    /* The cells themselves, and the glyphs reaching out of them. */
+    pixman_box32_t ink = {
+        x, y, x + length * layout->width, y + layout->height
+    };
+
+    renderer->impl->draw_cells(renderer, x, y, cells, length, layout,
+                               tracks_damage(renderer) ? &ink : NULL);
+
+    if (tracks_damage(renderer))
+        add_damage(renderer, ink.x1, ink.y1, ink.x2, ink.y2);
 }
 
 EXPORT
@@ -153,5 +382,6 @@ void wld_flush(struct wld_renderer * renderer)
 {
     renderer->impl->flush(renderer);
     renderer->impl->set_target(renderer, NULL);
+    renderer->target = NULL;
 }
 
@@ -57,6 +57,10 @@ static void registry_global(void * data, struct wl_registry * registry,
 static void registry_global_remove(void * data, struct wl_registry * registry,
                                    uint32_t name);
 
+static bool drm_initialize(struct drm_context * context,
+                           struct wl_display * display,
+                           struct wl_event_queue * queue);
+
 static void drm_device(void * data, struct wl_drm * wl, const char * name);
 static void drm_format(void * data, struct wl_drm * wl, uint32_t format);
 static void drm_authenticated(void * data, struct wl_drm * wl);
@@ -87,6 +91,7 @@ struct wayland_context * wayland_create_context(struct wl_display * display,
     context->wl = NULL;
     context->fd = -1;
     context->capabilities = 0;
+    context->authenticated = false;
     wl_array_init(&context->formats);
 
     if (!(context->registry = wl_display_get_registry(display)))
@@ -104,6 +109,76 @@ struct wayland_context * wayland_create_context(struct wl_display * display,
         goto error2;
     }
 
+    if (!drm_initialize(context, display, queue))
+        goto error2;
+
+    return &context->base;
+
+  error2:
+    wl_registry_destroy(context->registry);
+  error1:
+    wl_array_release(&context->formats);
+    free(context);
+  error0:
+    return NULL;
+}
+
+EXPORT
+struct wld_context * wld_wayland_create_drm_context
+    (struct wl_display * display, struct wl_registry * registry,
+     uint32_t name, uint32_t version)
+{
+    struct drm_context * context;
+    struct wl_event_queue * queue;
+
+    if (version < 2)
+        goto error0;
+
+    if (!(queue = wl_display_create_queue(display)))
+        goto error0;
+
+    if (!(context = malloc(sizeof *context)))
+        goto error1;
+
+    context_initialize(&context->base.base, &wld_context_impl);
+    context->registry = NULL;
+    context->fd = -1;
+    context->capabilities = 0;
+    context->authenticated = false;
+    wl_array_init(&context->formats);
+
+    /* The events of the new wl_drm go to our queue from the start. */
+    if (!(context->wl = wl_registry_bind(registry, name, &wl_drm_interface, 2)))
+        goto error2;
+
+    wl_proxy_set_queue((struct wl_proxy *) context->wl, queue);
+
+    if (!drm_initialize(context, display, queue))
+        goto error2;
+
+    context->base.impl = &drm_wayland_impl;
+    context->base.display = display;
+    context->base.queue = queue;
+
+    return &context->base.base;
+
+  error2:
+    wl_array_release(&context->formats);
+    free(context);
+  error1:
+    wl_event_queue_destroy(queue);
+  error0:
+    return NULL;
+}
+
+/**
+ * Sets up the bound wl_drm of the context: waits for its device and
+ * capabilities, then for the authentication, and opens the driver context.
+ * The wl_drm is destroyed on failure.
+ */
+bool drm_initialize(struct drm_context * context, struct wl_display * display,
+                    struct wl_event_queue * queue)
+{
     wl_drm_add_listener(context->wl, &drm_listener, context);
 
     /* Wait for DRM capabilities and device. */
@@ -112,13 +187,13 @@ struct wayland_context * wayland_create_context(struct wl_display * display,
     if (!(context->capabilities & WL_DRM_CAPABILITY_PRIME))
     {
         DEBUG("No PRIME support\n");
-        goto error3;
+        goto error0;
     }
 
     if (context->fd == -1)
     {
         DEBUG("No DRM device\n");
-        goto error3;
+        goto error0;
     }
 
     /* Wait for DRM authentication. */
@@ -127,28 +202,22 @@ struct wayland_context * wayland_create_context(struct wl_display * display,
     if (!context->authenticated)
     {
         DEBUG("DRM authentication failed\n");
-        goto error4;
+        goto error1;
     }
 
     if (!(context->driver_context = wld_drm_create_context(context->fd)))
     {
         DEBUG("Couldn't initialize context for DRM device\n");
-        goto error4;
+        goto error1;
     }
 
-    return &context->base;
+    return true;
 
-  error4:
-    close(context->fd);
-  error3:
-    wl_drm_destroy(context->wl);
-  error2:
-    wl_registry_destroy(context->registry);
   error1:
-    wl_array_release(&context->formats);
-    free(context);
+    close(context->fd);
   error0:
-    return NULL;
+    wl_drm_destroy(context->wl);
+    return false;
 }
 
 bool wayland_has_format(struct wld_context * base, uint32_t format)
@@ -236,7 +305,10 @@ void context_destroy(struct wld_context * base)
     wld_destroy_context(context->driver_context);
     close(context->fd);
     wl_drm_destroy(context->wl);
-    wl_registry_destroy(context->registry);
+
+    if (context->registry)
+        wl_registry_destroy(context->registry);
+
     wl_array_release(&context->formats);
     wl_event_queue_destroy(context->base.queue);
     free(context);
@@ -21,13 +21,14 @@
  * SOFTWARE.
  */
 
-#define _GNU_SOURCE /* Required for mkostemp */
+#define _GNU_SOURCE /* Required for mkostemp and memfd_create */
 
 #include "wayland.h"
 #include "wayland-private.h"
 #include "wld-private.h"
 #include "pixman.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,18 +36,59 @@
 #include <unistd.h>
 #include <wayland-client.h>
 
+/**
+ * One file shared by all the buffers of a context, so that creating a buffer
+ * only takes a range of it. The file and the wl_shm_pool only ever grow.
+ */
+struct shm_pool
+{
+    struct wl_shm_pool * wl;
+    int fd;
+    size_t size;
+
+    /* The ranges no buffer uses, as struct shm_range sorted by offset. */
+    struct wl_array free;
+
+    /**
+     * Where the ranges of destroyed buffers wait for the compositor, see
+     * buffer_destroy. The wrapper sends to the queue, and is NULL once the
+     * context is destroyed.
+     */
+    struct wl_display * display, * display_wrapper;
+    struct wl_event_queue * queue;
+    unsigned releasing;
+
+    /* The context and each buffer in the pool hold a reference. */
+    unsigned references;
+};
+
+struct shm_range
+{
+    size_t offset, size;
+};
+
+/* The range of a destroyed buffer, until the compositor is done with it. */
+struct shm_release
+{
+    struct shm_pool * pool;
+    struct shm_range range;
+    struct wl_callback * callback;
+};
+
 struct shm_context
 {
     struct wayland_context base;
     struct wl_registry * registry;
     struct wl_shm * wl;
     struct wl_array formats;
+    struct shm_pool * pool;
 };
 
 struct shm_buffer
 {
     struct buffer base;
-    int fd;
+    struct shm_pool * pool;
+    struct shm_range range;
 };
 
 #define WAYLAND_IMPL_NAME shm
@@ -64,6 +106,9 @@ static void registry_global_remove(void * data, struct wl_registry * registry,
 
 static void shm_format(void * data, struct wl_shm * wl, uint32_t format);
 
+static void release_done(void * data, struct wl_callback * callback,
+                         uint32_t time);
+
 const static struct wl_registry_listener registry_listener = {
     .global = &registry_global,
     .global_remove = &registry_global_remove
@@ -73,6 +118,10 @@ const static struct wl_shm_listener shm_listener = {
     .format = &shm_format,
 };
 
+const static struct wl_callback_listener release_listener = {
+    .done = &release_done,
+};
+
 static inline uint32_t format_wld_to_shm(uint32_t format)
 {
     switch (format)
@@ -81,11 +130,206 @@ static inline uint32_t format_wld_to_shm(uint32_t format)
             return WL_SHM_FORMAT_ARGB8888;
         case WLD_FORMAT_XRGB8888:
             return WL_SHM_FORMAT_XRGB8888;
+        case WLD_FORMAT_RGB565:
+            return WL_SHM_FORMAT_RGB565;
         default:
             return 0;
     }
 }
 
+/**
+ * Opens an anonymous file, sealed against shrinking where supported, since
+ * the compositor maps it too.
+ */
+static int open_pool_file(void)
+{
+    int fd;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("wld-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd >= 0)
+    {
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+        return fd;
+    }
+
+    if (errno != ENOSYS)
+        return -1;
+#endif
+
+    char name[] = "/tmp/wld-XXXXXX";
+
+    if ((fd = mkostemp(name, O_CLOEXEC)) >= 0)
+        unlink(name);
+
+    return fd;
+}
+
+static struct shm_pool * pool_create(struct wl_display * display,
+                                     struct wl_event_queue * queue)
+{
+    struct shm_pool * pool;
+
+    if (!(pool = malloc(sizeof *pool)))
+        goto error0;
+
+    if (!(pool->display_wrapper = wl_proxy_create_wrapper(display)))
+        goto error1;
+
+    if ((pool->fd = open_pool_file()) < 0)
+        goto error2;
+
+    wl_proxy_set_queue((struct wl_proxy *) pool->display_wrapper, queue);
+    pool->display = display;
+    pool->queue = queue;
+    pool->releasing = 0;
+    pool->wl = NULL;
+    pool->size = 0;
+    pool->references = 1;
+    wl_array_init(&pool->free);
+
+    return pool;
+
+  error2:
+    wl_proxy_wrapper_destroy(pool->display_wrapper);
+  error1:
+    free(pool);
+  error0:
+    return NULL;
+}
+
+static void pool_unreference(struct shm_pool * pool)
+{
+    if (--pool->references > 0)
+        return;
+
+    if (pool->wl)
+        wl_shm_pool_destroy(pool->wl);
+
+    close(pool->fd);
+    wl_array_release(&pool->free);
+    free(pool);
+}
+
+/**
+ * Returns the range to the free list, merging it with its neighbours.
+ */
+static bool pool_free(struct shm_pool * pool, struct shm_range range)
+{
+    struct shm_range * ranges = pool->free.data, * next;
+    size_t index, count = pool->free.size / sizeof *ranges;
+
+    for (index = 0; index < count && ranges[index].offset < range.offset;)
+        ++index;
+
+    if (index > 0 && ranges[index - 1].offset + ranges[index - 1].size
+                     == range.offset)
+    {
+        ranges[index - 1].size += range.size;
+
+        if (index < count && range.offset + range.size
+                             == ranges[index].offset)
+        {
+            ranges[index - 1].size += ranges[index].size;
+            memmove(&ranges[index], &ranges[index + 1],
+                    (count - index - 1) * sizeof *ranges);
+            pool->free.size -= sizeof *ranges;
+        }
+
+        return true;
+    }
+
+    if (index < count && range.offset + range.size == ranges[index].offset)
+    {
+        ranges[index].offset = range.offset;
+        ranges[index].size += range.size;
+        return true;
+    }
+
+    if (!wl_array_add(&pool->free, sizeof *ranges))
+        return false;
+
+    ranges = pool->free.data;
+    next = &ranges[index];
+    memmove(next + 1, next, (count - index) * sizeof *ranges);
+    *next = range;
+
+    return true;
+}
+
+/**
+ * Grows the file and the wl_shm_pool to make room for size more bytes, at
+ * least doubling them so that a series of resizes only grows them a few times.
+ */
+static bool pool_grow(struct shm_pool * pool, struct wl_shm * shm, size_t size)
+{
+    size_t new_size = pool->size * 2;
+
+    if (new_size < pool->size + size)
+        new_size = pool->size + size;
+
+    if (new_size > INT32_MAX)
+        return false;
+
+    if (posix_fallocate(pool->fd, pool->size, new_size - pool->size) != 0)
+        return false;
+
+    if (pool->wl)
+        wl_shm_pool_resize(pool->wl, new_size);
+    else if (!(pool->wl = wl_shm_create_pool(shm, pool->fd, new_size)))
+        return false;
+
+    pool_free(pool, (struct shm_range) { pool->size, new_size - pool->size });
+    pool->size = new_size;
+
+    return true;
+}
+
+/**
+ * Takes the first free range big enough for size bytes, rounded up to whole
+ * pages so that each buffer can be mapped on its own.
+ */
+static bool pool_alloc(struct shm_pool * pool, struct wl_shm * shm,
+                       size_t size, struct shm_range * range)
+{
+    struct shm_range * ranges;
+    size_t index, count, page_size = sysconf(_SC_PAGESIZE);
+
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    /* Take back the ranges the compositor is done with, without waiting. */
+    if (pool->releasing > 0)
+        wl_display_dispatch_queue_pending(pool->display, pool->queue);
+
+    do
+    {
+        ranges = pool->free.data;
+        count = pool->free.size / sizeof *ranges;
+
+        for (index = 0; index < count; ++index)
+        {
+            if (ranges[index].size < size)
+                continue;
+
+            range->offset = ranges[index].offset;
+            range->size = size;
+            ranges[index].offset += size;
+
+            if ((ranges[index].size -= size) == 0)
+            {
+                memmove(&ranges[index], &ranges[index + 1],
+                        (count - index - 1) * sizeof *ranges);
+                pool->free.size -= sizeof *ranges;
+            }
+
+            return true;
+        }
+    } while (pool_grow(pool, shm, size));
+
+    return false;
+}
+
 struct wayland_context * wayland_create_context(struct wl_display * display,
                                                 struct wl_event_queue * queue)
 {
@@ -96,6 +340,7 @@ struct wayland_context * wayland_create_context(struct wl_display * display,
 
     context_initialize(&context->base.base, &wld_context_impl);
     context->wl = NULL;
+    context->pool = NULL;
     wl_array_init(&context->formats);
 
     if (!(context->registry = wl_display_get_registry(display)))
@@ -132,12 +377,56 @@ struct wayland_context * wayland_create_context(struct wl_display * display,
     return NULL;
 }
 
+EXPORT
+struct wld_context * wld_wayland_create_shm_context(struct wl_display * display,
+                                                    struct wl_shm * shm)
+{
+    struct shm_context * context;
+    struct wl_event_queue * queue;
+
+    if (!(queue = wl_display_create_queue(display)))
+        goto error0;
+
+    if (!(context = malloc(sizeof *context)))
+        goto error1;
+
+    context_initialize(&context->base.base, &wld_context_impl);
+    context->registry = NULL;
+    context->pool = NULL;
+    wl_array_init(&context->formats);
+
+    /* Create the pools and buffers on our queue, as with our own wl_shm. */
+    if (!(context->wl = wl_proxy_create_wrapper(shm)))
+        goto error2;
+
+    wl_proxy_set_queue((struct wl_proxy *) context->wl, queue);
+    wl_shm_add_listener(shm, &shm_listener, context);
+
+    context->base.impl = &shm_wayland_impl;
+    context->base.display = display;
+    context->base.queue = queue;
+
+    return &context->base.base;
+
+  error2:
+    wl_array_release(&context->formats);
+    free(context);
+  error1:
+    wl_event_queue_destroy(queue);
+  error0:
+    return NULL;
+}
+
 bool wayland_has_format(struct wld_context * base, uint32_t format)
 {
     struct shm_context * context = shm_context(base);
     uint32_t * supported_format;
     uint32_t shm_format = format_wld_to_shm(format);
 
+    /* All compositors support these, whether or not they were announced. */
+    if (format == WLD_FORMAT_ARGB8888 || format == WLD_FORMAT_XRGB8888)
+        return true;
+
     wl_array_for_each(supported_format, &context->formats)
     {
         if (*supported_format == shm_format)
@@ -158,42 +447,40 @@ struct buffer * context_create_buffer(struct wld_context * base,
 {
     struct shm_context * context = shm_context(base);
     struct shm_buffer * buffer;
-    char name[] = "/tmp/wld-XXXXXX";
-    uint32_t pitch = width * format_bytes_per_pixel(format);
+    /* pixman needs rows aligned to 4 bytes, which 16-bit formats are not */
+    uint32_t pitch = (width * format_bytes_per_pixel(format) + 3) & ~3;
     size_t size = pitch * height;
-    int fd;
-    struct wl_shm_pool * pool;
     struct wl_buffer * wl;
 
     if (!wayland_has_format(base, format))
         goto error0;
 
+    if (!context->pool)
+    {
+        context->pool = pool_create(context->base.display,
+                                    context->base.queue);
+
+        if (!context->pool)
+            goto error0;
+    }
+
     if (!(buffer = malloc(sizeof *buffer)))
         goto error0;
 
-    fd = mkostemp(name, O_CLOEXEC);
-
-    if (fd < 0)
+    if (!pool_alloc(context->pool, context->wl, size, &buffer->range))
         goto error1;
 
-    unlink(name);
-
-    if (posix_fallocate(fd, 0, size) != 0)
-        goto error2;
-
-    if (!(pool = wl_shm_create_pool(context->wl, fd, size)))
-        goto error2;
-
-    wl = wl_shm_pool_create_buffer(pool, 0, width, height, pitch,
+    wl = wl_shm_pool_create_buffer(context->pool->wl, buffer->range.offset,
+                                   width, height, pitch,
                                    format_wld_to_shm(format));
-    wl_shm_pool_destroy(pool);
 
     if (!wl)
         goto error2;
 
     buffer_initialize(&buffer->base, &wld_buffer_impl,
                       width, height, format, pitch);
-    buffer->fd = fd;
+    buffer->pool = context->pool;
+    ++buffer->pool->references;
 
     if (!(wayland_buffer_add_exporter(&buffer->base, wl)))
         goto error3;
@@ -201,9 +488,10 @@ struct buffer * context_create_buffer(struct wld_context * base,
     return &buffer->base;
 
   error3:
+    pool_unreference(buffer->pool);
     wl_buffer_destroy(wl);
   error2:
-    close(fd);
+    pool_free(context->pool, buffer->range);
   error1:
     free(buffer);
   error0:
@@ -222,8 +510,28 @@ void context_destroy(struct wld_context * base)
 {
     struct shm_context * context = shm_context(base);
 
-    wl_shm_destroy(context->wl);
-    wl_registry_destroy(context->registry);
+    if (context->pool)
+    {
+        /* Wait for the ranges on their way back, since the queue goes away. */
+        if (context->pool->releasing > 0)
+        {
+            wl_display_roundtrip_queue(context->pool->display,
+                                       context->pool->queue);
+        }
+
+        wl_proxy_wrapper_destroy(context->pool->display_wrapper);
+        context->pool->display_wrapper = NULL;
+        pool_unreference(context->pool);
+    }
+
+    if (context->registry)
+    {
+        wl_shm_destroy(context->wl);
+        wl_registry_destroy(context->registry);
+    }
+    else
+        wl_proxy_wrapper_destroy(context->wl);
+
     wl_array_release(&context->formats);
     wl_event_queue_destroy(context->base.queue);
     free(context);
@@ -237,7 +545,8 @@ bool buffer_map(struct buffer * base)
     void * data;
 
     data = mmap(NULL, buffer->base.base.pitch * buffer->base.base.height,
-                PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd, 0);
+                PROT_READ | PROT_WRITE, MAP_SHARED, buffer->pool->fd,
+                buffer->range.offset);
 
     if (data == MAP_FAILED)
         return false;
@@ -260,12 +569,39 @@ bool buffer_unmap(struct buffer * buffer)
     return true;
 }
 
+/**
+ * The wl_buffer is already destroyed, but the compositor may still show its
+ * contents until it handles that and whatever was committed before it. So the
+ * range only goes back to the free list once a sync sent after the destroy is
+ * done, keeping the buffer's reference on the pool until then.
+ */
 void buffer_destroy(struct buffer * base)
 {
     struct shm_buffer * buffer = shm_buffer(&base->base);
+    struct shm_pool * pool = buffer->pool;
+    struct shm_range range = buffer->range;
+    struct shm_release * release;
 
-    close(buffer->fd);
     free(buffer);
+
+    if (!pool->display_wrapper || !(release = malloc(sizeof *release)))
+        goto error0;
+
+    if (!(release->callback = wl_display_sync(pool->display_wrapper)))
+        goto error1;
+
+    release->pool = pool;
+    release->range = range;
+    wl_callback_add_listener(release->callback, &release_listener, release);
+    ++pool->releasing;
+
+    return;
+
+  error1:
+    free(release);
+  error0:
+    pool_free(pool, range);
+    pool_unreference(pool);
 }
 
 void registry_global(void * data, struct wl_registry * registry, uint32_t name,
@@ -292,3 +628,14 @@ void shm_format(void * data, struct wl_shm * wl, uint32_t format)
     *added_format = format;
 }
 
+
+void release_done(void * data, struct wl_callback * callback, uint32_t time)
+{
+    struct shm_release * release = data;
+
+    --release->pool->releasing;
+    pool_free(release->pool, release->range);
+    pool_unreference(release->pool);
+    wl_callback_destroy(callback);
+    free(release);
+}
@@ -27,6 +27,7 @@
 #include "wld.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <ft2build.h>
@@ -54,6 +55,12 @@
 struct wld_font_context
 {
     FT_Library library;
+
+    /* The id of the next font opened, taken atomically. */
+    uintptr_t next_font_id;
+
+    /* Serializes creating and destroying faces in the FreeType library. */
+    pthread_mutex_t lock;
 };
 
 struct glyph
@@ -69,15 +76,87 @@ struct glyph
      * The width to advance to the origin of the next character.
      */
     uint16_t advance;
+
+    FT_UInt index;
+
+    /**
+     * For grayscale glyphs, a copy of the bitmap thresholded to 1 bit per
+     * pixel, made by font_mono_bitmap.
+     */
+    uint8_t * mono;
 };
 
+/* Characters with their own slot in font.char_glyphs */
+#define FONT_CHAR_DIRECT 256
+/* Direct-mapped slots for the other characters */
+#define FONT_CHAR_HASH 256
+
+struct font_arena;
+
 struct font
 {
     struct wld_font base;
 
     struct wld_font_context * context;
     FT_Face face;
-    struct glyph ** glyphs;
+
+    /**
+     * Identifies the font in glyph caches. Unlike the address of the font, it
+     * is never reused after the font is closed.
+     */
+    uintptr_t id;
+
+    /**
+     * The loaded glyphs, indexed by glyph index, in pages that are only
+     * allocated when one of their glyphs is loaded.
+     */
+    struct glyph *** glyph_pages;
+
+    /**
+     * The memory of the pages, the glyphs and their bitmaps, released when
+     * the font is closed.
+     */
+    struct font_arena * arena;
+
+    /**
+     * What the bitmaps were rendered from, checked against glyph cache files.
+     * file is NULL if the face was not loaded from a file.
+     */
+    char * file;
+    int64_t file_mtime;
+    uint64_t file_size;
+    double pixel_size, aspect;
+
+    /* The wld_font_style applied to the glyphs of the face. */
+    uint32_t synthetic;
+
+    /**
+     * How glyphs are loaded, from the antialiasing and hinting settings of
+     * the pattern: monochrome or 8-bit grayscale.
+     */
+    FT_Int32 load_flags;
+
+    /* Glyph lookups, glyphs loaded and memory used, for wld_font_get_stats. */
+    uint32_t hits, misses, glyphs;
+    size_t memory;
+
+    /**
+     * A glyph cache file mapped by wld_font_read_glyph_cache, holding the
+     * bitmaps of the glyphs loaded from it.
+     */
+    void * cache;
+    size_t cache_size;
+
+    /**
+     * Glyphs by character, so that drawing a character seen before skips
+     * FT_Get_Char_Index. NULL if the character has not been looked up yet.
+     */
+    struct glyph * char_glyphs[FONT_CHAR_DIRECT];
+    struct
+    {
+        uint32_t character;
+        struct glyph * glyph;
+    } char_hash[FONT_CHAR_HASH];
 };
 
 struct wld_context_impl
@@ -113,10 +192,20 @@ struct wld_renderer_impl
     void (* copy_region)(struct wld_renderer * renderer, struct buffer * src,
                          int32_t dst_x, int32_t dst_y,
                          pixman_region32_t * region);
+    void (* scroll_rectangle)(struct wld_renderer * renderer,
+                              int32_t x, int32_t y,
+                              uint32_t width, uint32_t height, int32_t dy);
+    /* If ink is not NULL, the text and cell methods grow it with
+     * glyph_extend_ink for each glyph they draw. */
     void (* draw_text)(struct wld_renderer * renderer,
                        struct font * font, uint32_t color,
-                       int32_t x, int32_t y, const char * text, uint32_t length,
-                       struct wld_extents * extents);
+                       int32_t x, int32_t y,
+                       const uint32_t * chars, uint32_t length,
+                       struct wld_extents * extents, pixman_box32_t * ink);
+    void (* draw_cells)(struct wld_renderer * renderer, int32_t x, int32_t y,
+                        const struct wld_cell * cells, uint32_t length,
+                        const struct wld_cell_layout * layout,
+                        pixman_box32_t * ink);
     void (* flush)(struct wld_renderer * renderer);
     void (* destroy)(struct wld_renderer * renderer);
 };
@@ -160,7 +249,44 @@ struct buffer_socket_impl
     void (* destroy)(struct buffer_socket * socket);
 };
 
-bool font_ensure_glyph(struct font * font, FT_UInt glyph_index);
+/**
+ * Returns the glyph with the given index, loading it if necessary, or NULL if
+ * the font has no such glyph.
+ */
+struct glyph * font_ensure_glyph(struct font * font, FT_UInt glyph_index);
+
+/**
+ * Returns the glyph for the given character, or NULL if the font has none.
+ */
+struct glyph * font_ensure_char(struct font * font, uint32_t character);
+
+/**
+ * Stores in bitmap the glyph's bitmap at 1 bit per pixel, thresholding it
+ * once if it is grayscale, for renderers that only draw monochrome glyphs.
+ */
+bool font_mono_bitmap(struct font * font, struct glyph * glyph,
+                      FT_Bitmap * bitmap);
+
+/**
+ * Grows the box ink to the bitmap of a glyph with its origin at x, y, since
+ * glyphs may reach past their advance and the ascent of the font.
+ */
+static inline void glyph_extend_ink(struct glyph * glyph, int32_t x, int32_t y,
+                                    pixman_box32_t * ink)
+{
+    if (glyph->bitmap.width == 0 || glyph->bitmap.rows == 0)
+        return;
+
+    x += glyph->x;
+    y += glyph->y;
+
+    if (x < ink->x1) ink->x1 = x;
+    if (y < ink->y1) ink->y1 = y;
+    if (x + (int32_t) glyph->bitmap.width > ink->x2)
+        ink->x2 = x + glyph->bitmap.width;
+    if (y + (int32_t) glyph->bitmap.rows > ink->y2)
+        ink->y2 = y + glyph->bitmap.rows;
+}
 
 /**
  * Returns the number of bytes per pixel for the given format.
@@ -172,6 +298,8 @@ static inline uint8_t format_bytes_per_pixel(enum wld_format format)
         case WLD_FORMAT_ARGB8888:
         case WLD_FORMAT_XRGB8888:
             return 4;
+        case WLD_FORMAT_RGB565:
+            return 2;
         default:
             return 0;
     }
@@ -185,6 +313,8 @@ static inline pixman_format_code_t format_wld_to_pixman(uint32_t format)
             return PIXMAN_a8r8g8b8;
         case WLD_FORMAT_XRGB8888:
             return PIXMAN_x8r8g8b8;
+        case WLD_FORMAT_RGB565:
+            return PIXMAN_r5g6b5;
         default:
             return 0;
     }
@@ -198,6 +328,8 @@ static inline uint32_t format_pixman_to_wld(pixman_format_code_t format)
             return WLD_FORMAT_ARGB8888;
         case PIXMAN_x8r8g8b8:
             return WLD_FORMAT_XRGB8888;
+        case PIXMAN_r5g6b5:
+            return WLD_FORMAT_RGB565;
         default:
             return 0;
     }
@@ -216,6 +348,23 @@ void default_copy_region(struct wld_renderer * renderer, struct buffer * buffer,
                          int32_t dst_x, int32_t dst_y,
                          pixman_region32_t * region);
 
+/**
+ * This default scroll_rectangle method is implemented in terms of
+ * copy_rectangle from the target, in bands that do not overlap.
+ */
+void default_scroll_rectangle(struct wld_renderer * renderer,
+                              int32_t x, int32_t y,
+                              uint32_t width, uint32_t height, int32_t dy);
+
+/**
+ * This default draw_cells method is implemented in terms of fill_rectangle and
+ * draw_text.
+ */
+void default_draw_cells(struct wld_renderer * renderer, int32_t x, int32_t y,
+                        const struct wld_cell * cells, uint32_t length,
+                        const struct wld_cell_layout * layout,
+                        pixman_box32_t * ink);
+
 struct wld_surface * default_create_surface(struct wld_context * context,
                                             uint32_t width, uint32_t height,
                                             uint32_t format, uint32_t flags);
@@ -10,6 +10,7 @@
 #include <libgen.h>
 #include <linux/input.h>
 #include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -51,7 +52,6 @@ char *argv0;
 #define ESC_ARG_SIZ 16
 #define STR_BUF_SIZ ESC_BUF_SIZ
 #define STR_ARG_SIZ ESC_ARG_SIZ
-#define DRAW_BUF_SIZ 20 * 1024
 #define XK_ANY_MOD UINT_MAX
 #define XK_NO_MOD 0
 #define XK_SWITCH_MOD (1 << 13)
@@ -241,7 +241,9 @@ typedef struct {
 typedef struct {
   struct wl_display *dpy;
   struct wl_compositor *cmp;
+  struct wl_subcompositor *subcmp;
   struct wl_shm *shm;
+  uint32_t drm, drmversion; /* the wl_drm global, if any */
   struct wl_seat *seat;
   struct wl_keyboard *keyboard;
   struct wl_pointer *pointer;
@@ -250,6 +252,9 @@ typedef struct {
   struct wl_data_offer *seloffer;
   struct wl_surface *surface;
   struct wl_buffer *buffer;
+  struct wl_surface *cursurface; /* text cursor, a subsurface of surface */
+  struct wl_subsurface *cursubsurf;
+  struct wl_buffer *curbuffer;
   struct xdg_wm_base *xdgshell;
   struct wl_shell *shell;
   struct wl_shell_surface *shellsurf;
@@ -269,11 +274,26 @@ typedef struct {
   struct wl_callback *framecb;
 } Wayland;
 
+/* What decides the pixels of a cell, see rowchanged */
+typedef struct {
+  uint32_t u, mode, fg, bg;
+} DrawnCell;
+
 typedef struct {
   struct wld_context *ctx;
+  struct wld_context *shmctx; /* ctx unless wl_drm is used, see wlinit */
   struct wld_font_context *fontctx;
   struct wld_renderer *renderer;
   struct wld_buffer *buffer, *oldbuffer;
+  struct wld_buffer *curbuffer, *oldcurbuffer;
+  int ox, oy; /* window position of the target buffer */
+  uint32_t *rowhash; /* of the rows the buffer holds, 0 if unknown */
+  DrawnCell *drawn;  /* the cells of those rows, term.col per row */
+  DrawnCell *rowbuf; /* the row being compared with them */
+  uchar *pending;    /* rows drawn with fallback placeholders */
+  int scrolltop, scrollbot, scrolln; /* a scroll yet to be done, see wlscroll */
+  struct wld_cell *cells; /* a row for wld_draw_cells */
+  FILE *listfile;         /* where frames are dumped, see wlrecord */
 } WLD;
 
 typedef struct {
@@ -361,6 +381,19 @@ static void toggleprinter(const Arg *);
 /* Config.h for applying patches and the configuration. */
 #include "config.h"
 
+/* Codepoints covered by the same font of a style's fallback set */
+typedef struct {
+  Rune first, last;
+  int font; /* index in Coverset.set */
+} Coverage;
+
+/* A style's sorted fallback set and the codepoints its fonts cover */
+typedef struct {
+  FcFontSet *set;
+  Coverage *cover; /* sorted */
+  int len;         /* -1 if not built yet */
+} Coverset;
+
 /* Font structure */
 typedef struct {
   int height;
@@ -370,8 +403,10 @@ typedef struct {
   short lbearing;
   short rbearing;
   struct wld_font *match;
-  FcFontSet *set;
   FcPattern *pattern;
+  Coverset cov;      /* built by the worker on the first fallback */
+  FcChar8 *matchname; /* the match for the font cache, if enabled */
+  int synth;         /* styles derived from the regular font, see wld.h */
 } Font;
 
 /* Drawing Context */
@@ -380,6 +415,42 @@ typedef struct {
   Font font, bfont, ifont, ibfont;
 } DC;
 
+/*
+ * Fallback fonts for characters missing from the main fonts, opened on demand
+ * and closed least recently used first once the array is full. gen changes
+ * whenever a slot is reused, which invalidates the codepoints mapped to it.
+ */
+typedef struct {
+  struct wld_font *font;
+  char *file;
+  int index;
+  uint gen;
+  ulong used;
+} Fontcache;
+
+static Fontcache frc[64];
+static int frclen = 0;
+static ulong frcclock = 0;
+
+/*
+ * The fonts of recently used sizes other than the current one, with the
+ * fallback fonts opened at that size, kept open so that zooming back to them
+ * needs neither fontconfig nor the disk and finds their glyphs still
+ * rasterized.
+ */
+typedef struct {
+  double size;
+  Font font, bfont, ifont, ibfont;
+  Fontcache frc[LEN(frc)];
+  int frclen;
+  int cw, ch;
+  ulong used;
+} Fontsize;
+
+static Fontsize fontsizes[4];
+static int fontsizeslen = 0;
+static ulong fontsizesclock = 0;
+
 static void die(const char *, ...);
 static void draw(void);
 static void redraw(void);
@@ -389,6 +460,8 @@ static void stty(void);
 static void sigchld(int);
 static void run(void);
 static void cresize(int, int);
+static int wlsetsize(int, int);
+static void resizeframe(void);
 
 static void csidump(void);
 static void csihandle(void);
@@ -444,24 +517,44 @@ static void ttywrite(const char *, size_t);
 static void tstrsequence(uchar);
 
 static inline uchar sixd_to_8bit(int);
-static void wldraws(char *, Glyph, int, int, int, int);
+static void wldraws(const Rune *, Glyph, int, int, int, int);
+static void wldrawbox(Rune, int, int, uint32_t, uint32_t);
+static void wldrawpending(int, int, int, uint32_t);
+static void wldrawrow(int, int, int, int);
+static void wldrawcells(int, int, int, int, struct wld_cell_layout *);
+static void wlrecord(const char *);
+static void wldumpframe(void);
+static int wlsubmitdamage(struct wl_surface *, struct wld_buffer *);
 static void wldrawglyph(Glyph, int, int);
 static void wlclear(int, int, int, int);
-static void wldrawcursor(void);
+static void wldrawcursor(int);
 static void wlinit(void);
 static void wlloadcols(void);
 static int wlsetcolorname(int, const char *);
 static void wlloadcursor(void);
 static int wlloadfont(Font *, FcPattern *);
+static int wlopenfont(Font *, FcPattern *, FcPattern *);
+static int wlderivefont(Font *, FcPattern *, int);
+static int wlloadstyle(Font *, FcPattern *, int);
+static void wlinitfont(Font *, FcPattern *, FcChar8 *, int);
+static int glyphcachepath(Font *, char *, size_t);
 static void wlloadfonts(char *, double);
+static uint32_t fontcachekey(char *, double);
+static int wlloadcachedfonts(char *, double);
+static void wlsavecachedfonts(char *, double);
+static void wlsaveglyphs(void);
+static void prewarmreset(void);
+static void prewarmstep(void);
 static void wlsettitle(char *);
 static void wlresettitle(void);
 static void wlseturgency(int);
 static void wlsetsel(char *, uint32_t);
-static void wltermclear(int, int, int, int);
 static void wlunloadfont(Font *f);
 static void wlunloadfonts(void);
+static void wlstashfonts(void);
+static int wlunstashfonts(double);
 static void wlresize(int, int);
+static void wlsetopaque(void);
 
 static void regglobal(void *, struct wl_registry *, uint32_t, const char *,
                       uint32_t);
@@ -556,6 +649,23 @@ static struct wl_data_source_listener datasrclistener = {
 
 /* Globals */
 static DC dc;
+/* The fonts in the order of the font cache file */
+static Font *cachedfonts[] = {&dc.font, &dc.ifont, &dc.ibfont, &dc.bfont};
+
+/* How far the idle rasterization of prewarmranges has got */
+static struct {
+  int active;
+  int font, range;
+  Rune next;
+} prewarm;
+
+/* Configures not applied yet and a size the tty has not been told of */
+static struct {
+  int pending;
+  int w, h;
+  int tty;
+  struct timespec last; /* when the grid last changed size */
+} resizes;
 static Wayland wl;
 static WLD wld;
 static Cursor cursor;
@@ -588,15 +698,226 @@ static Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
 /* Font Ring Cache */
 enum { FRC_NORMAL, FRC_ITALIC, FRC_BOLD, FRC_ITALICBOLD };
 
+/*
+ * Codepoint to fallback font map, an open addressing hash table. A font of -1
+ * records that no font has the character, FALLBACK_PENDING that the worker
+ * is still looking for one.
+ */
+#define FALLBACK_PENDING -2
+
 typedef struct {
-  struct wld_font *font;
+  bool used;
+  Rune u;
   int flags;
-  Rune unicodep;
-} Fontcache;
+  int font;
+  uint gen;
+} Fallback;
 
-/* Fontcache is an array now. A new font will be appended to the array. */
-static Fontcache frc[16];
-static int frclen = 0;
+static Fallback fallback[4096];
+static int fallbacklen = 0;
+
+/*
+ * Fallback fonts are found and opened on a worker thread, so that a character
+ * missing from the main fonts never stalls a frame. It is drawn as a
+ * placeholder box until the worker is done, then its row is drawn again.
+ * lock protects the job queues, frc and the coverage of the fonts, which only
+ * the main thread changes. The worker opens new fonts itself, which wld allows
+ * on any thread, and hands them over to the main thread.
+ */
+typedef struct {
+  Font *font;
+  Rune u;
+  int flags;
+  /* result: an open font and its generation, or a newly opened one */
+  int slot;
+  uint gen;
+  struct wld_font *match;
+  char *file;
+  int index;
+  Coverset cov; /* built for font, if len is not -1 */
+} Fallbackjob;
+
+static struct {
+  pthread_t thread;
+  bool started, busy;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  Fallbackjob jobs[256], done[256];
+  int njobs, ndone;
+  int pipe[2]; /* wakes up the main loop when jobs are done */
+} fbw = {.lock = PTHREAD_MUTEX_INITIALIZER,
+         .cond = PTHREAD_COND_INITIALIZER,
+         .pipe = {-1, -1}};
+
+static int fallbackfont(Font *, Rune, int);
+static void *fallbackworker(void *);
+static void fallbackresolve(Fallbackjob *);
+static void fallbackdone(void);
+static void fallbackdrain(void);
+static void coverbuild(Coverset *, FcPattern *);
+static void coverfree(Coverset *);
+static int coverfind(Coverset *, Rune);
+static int coverload(Coverset *, const char *);
+static void coversave(Coverset *, const char *);
+static int cachepath(char *, size_t, const char *, uint32_t);
+static int mkdirs(char *, mode_t);
+static uint32_t strhash(uint32_t, const char *);
+
+/* Font and colors a glyph is drawn with */
+typedef struct {
+  Font *font;
+  int frcflags;
+  uint32_t fg;
+  uint32_t bg; /* with term_alpha applied */
+} Style;
+
+/*
+ * Resolved styles, keyed by the glyph attributes and the global modes they
+ * depend on. Cleared whenever the palette changes.
+ */
+static struct {
+  bool valid;
+  ushort mode;
+  uint32_t fg, bg;
+  int reverse, blink;
+  Style style;
+} stylecache[64];
+
+static const Style *wlstyle(Glyph);
+static void wlresolvestyle(Glyph, Style *);
+static void stylereset(void);
+
+/* Background of the frame being drawn, one region per color. */
+static struct {
+  uint32_t color;
+  pixman_region32_t region;
+} bgspans[16];
+static int bgspanslen = 0;
+
+static void bgspan(uint32_t, int, int, int, int);
+static void bgflush(void);
+
+static struct {
+  ulong rowsskipped, rowsdrawn;
+  ulong fallbackhits, fallbackmisses, fallbacknone, fallbackpending;
+} stats;
+
+static int rowchanged(int, int);
+static void wlscroll(int, int, int);
+static void wlscrollbuffer(void);
+static void wlforgetrows(int, int);
+static void dumpstats(void);
+
+/*
+ * Box-drawing, block element and braille characters are not taken from the
+ * font, but built from rectangles sized to the character cell. Each
+ * character's mask is built once per cell size and kept as a region relative
+ * to the top left corner of the cell.
+ */
+#define BOX_BLOCKS 0xA0   /* U+2500 - U+259F */
+#define BOX_BRAILLE 0x100 /* U+2800 - U+28FF */
+#define ISBOXDRAW(u)                                                           \
+  (boxdraw && (BETWEEN(u, 0x2500, 0x259F) ||                                   \
+               (boxdraw_braille && BETWEEN(u, 0x2800, 0x28FF))))
+
+enum { BOX_NONE, BOX_LIGHT, BOX_HEAVY, BOX_DOUBLE };
+
+/* line weight of each arm: left, up, right, down */
+#define BOXL(l, u, r, d) ((l) | (u) << 2 | (r) << 4 | (d) << 6)
+#define BOXARM(b, i) (((b) >> (2 * (i))) & 3)
+#define BOXDASH(n) (((n)-1) << 8) /* dashed line with n segments */
+#define BOXDASHES(b) ((((b) >> 8) & 3) + 1)
+#define BOX_DIAGR (1 << 10) /* upper right to lower left */
+#define BOX_DIAGL (1 << 11) /* upper left to lower right */
+
+static const ushort boxlines[] = {
+    /* ─ ━ │ ┃ */
+    BOXL(1, 0, 1, 0), BOXL(2, 0, 2, 0), BOXL(0, 1, 0, 1), BOXL(0, 2, 0, 2),
+    /* ┄ ┅ ┆ ┇ */
+    BOXDASH(3) | BOXL(1, 0, 1, 0), BOXDASH(3) | BOXL(2, 0, 2, 0),
+    BOXDASH(3) | BOXL(0, 1, 0, 1), BOXDASH(3) | BOXL(0, 2, 0, 2),
+    /* ┈ ┉ ┊ ┋ */
+    BOXDASH(4) | BOXL(1, 0, 1, 0), BOXDASH(4) | BOXL(2, 0, 2, 0),
+    BOXDASH(4) | BOXL(0, 1, 0, 1), BOXDASH(4) | BOXL(0, 2, 0, 2),
+    /* ┌ ┍ ┎ ┏ */
+    BOXL(0, 0, 1, 1), BOXL(0, 0, 2, 1), BOXL(0, 0, 1, 2), BOXL(0, 0, 2, 2),
+    /* ┐ ┑ ┒ ┓ */
+    BOXL(1, 0, 0, 1), BOXL(2, 0, 0, 1), BOXL(1, 0, 0, 2), BOXL(2, 0, 0, 2),
+    /* └ ┕ ┖ ┗ */
+    BOXL(0, 1, 1, 0), BOXL(0, 1, 2, 0), BOXL(0, 2, 1, 0), BOXL(0, 2, 2, 0),
+    /* ┘ ┙ ┚ ┛ */
+    BOXL(1, 1, 0, 0), BOXL(2, 1, 0, 0), BOXL(1, 2, 0, 0), BOXL(2, 2, 0, 0),
+    /* ├ ┝ ┞ ┟ */
+    BOXL(0, 1, 1, 1), BOXL(0, 1, 2, 1), BOXL(0, 2, 1, 1), BOXL(0, 1, 1, 2),
+    /* ┠ ┡ ┢ ┣ */
+    BOXL(0, 2, 1, 2), BOXL(0, 2, 2, 1), BOXL(0, 1, 2, 2), BOXL(0, 2, 2, 2),
+    /* ┤ ┥ ┦ ┧ */
+    BOXL(1, 1, 0, 1), BOXL(2, 1, 0, 1), BOXL(1, 2, 0, 1), BOXL(1, 1, 0, 2),
+    /* ┨ ┩ ┪ ┫ */
+    BOXL(1, 2, 0, 2), BOXL(2, 2, 0, 1), BOXL(2, 1, 0, 2), BOXL(2, 2, 0, 2),
+    /* ┬ ┭ ┮ ┯ */
+    BOXL(1, 0, 1, 1), BOXL(2, 0, 1, 1), BOXL(1, 0, 2, 1), BOXL(2, 0, 2, 1),
+    /* ┰ ┱ ┲ ┳ */
+    BOXL(1, 0, 1, 2), BOXL(2, 0, 1, 2), BOXL(1, 0, 2, 2), BOXL(2, 0, 2, 2),
+    /* ┴ ┵ ┶ ┷ */
+    BOXL(1, 1, 1, 0), BOXL(2, 1, 1, 0), BOXL(1, 1, 2, 0), BOXL(2, 1, 2, 0),
+    /* ┸ ┹ ┺ ┻ */
+    BOXL(1, 2, 1, 0), BOXL(2, 2, 1, 0), BOXL(1, 2, 2, 0), BOXL(2, 2, 2, 0),
+    /* ┼ ┽ ┾ ┿ */
+    BOXL(1, 1, 1, 1), BOXL(2, 1, 1, 1), BOXL(1, 1, 2, 1), BOXL(2, 1, 2, 1),
+    /* ╀ ╁ ╂ ╃ */
+    BOXL(1, 2, 1, 1), BOXL(1, 1, 1, 2), BOXL(1, 2, 1, 2), BOXL(2, 2, 1, 1),
+    /* ╄ ╅ ╆ ╇ */
+    BOXL(1, 2, 2, 1), BOXL(2, 1, 1, 2), BOXL(1, 1, 2, 2), BOXL(2, 2, 2, 1),
+    /* ╈ ╉ ╊ ╋ */
+    BOXL(2, 1, 2, 2), BOXL(2, 2, 1, 2), BOXL(1, 2, 2, 2), BOXL(2, 2, 2, 2),
+    /* ╌ ╍ ╎ ╏ */
+    BOXDASH(2) | BOXL(1, 0, 1, 0), BOXDASH(2) | BOXL(2, 0, 2, 0),
+    BOXDASH(2) | BOXL(0, 1, 0, 1), BOXDASH(2) | BOXL(0, 2, 0, 2),
+    /* ═ ║ ╒ ╓ */
+    BOXL(3, 0, 3, 0), BOXL(0, 3, 0, 3), BOXL(0, 0, 3, 1), BOXL(0, 0, 1, 3),
+    /* ╔ ╕ ╖ ╗ */
+    BOXL(0, 0, 3, 3), BOXL(3, 0, 0, 1), BOXL(1, 0, 0, 3), BOXL(3, 0, 0, 3),
+    /* ╘ ╙ ╚ ╛ */
+    BOXL(0, 1, 3, 0), BOXL(0, 3, 1, 0), BOXL(0, 3, 3, 0), BOXL(3, 1, 0, 0),
+    /* ╜ ╝ ╞ ╟ */
+    BOXL(1, 3, 0, 0), BOXL(3, 3, 0, 0), BOXL(0, 1, 3, 1), BOXL(0, 3, 1, 3),
+    /* ╠ ╡ ╢ ╣ */
+    BOXL(0, 3, 3, 3), BOXL(3, 1, 0, 1), BOXL(1, 3, 0, 3), BOXL(3, 3, 0, 3),
+    /* ╤ ╥ ╦ ╧ */
+    BOXL(3, 0, 3, 1), BOXL(1, 0, 1, 3), BOXL(3, 0, 3, 3), BOXL(3, 1, 3, 0),
+    /* ╨ ╩ ╪ ╫ */
+    BOXL(1, 3, 1, 0), BOXL(3, 3, 3, 0), BOXL(3, 1, 3, 1), BOXL(1, 3, 1, 3),
+    /* ╬ ╭ ╮ ╯ (arcs are drawn as plain corners) */
+    BOXL(3, 3, 3, 3), BOXL(0, 0, 1, 1), BOXL(1, 0, 0, 1), BOXL(1, 1, 0, 0),
+    /* ╰ ╱ ╲ ╳ */
+    BOXL(0, 1, 1, 0), BOX_DIAGR, BOX_DIAGL, BOX_DIAGR | BOX_DIAGL,
+    /* ╴ ╵ ╶ ╷ */
+    BOXL(1, 0, 0, 0), BOXL(0, 1, 0, 0), BOXL(0, 0, 1, 0), BOXL(0, 0, 0, 1),
+    /* ╸ ╹ ╺ ╻ */
+    BOXL(2, 0, 0, 0), BOXL(0, 2, 0, 0), BOXL(0, 0, 2, 0), BOXL(0, 0, 0, 2),
+    /* ╼ ╽ ╾ ╿ */
+    BOXL(1, 0, 2, 0), BOXL(0, 1, 0, 2), BOXL(2, 0, 1, 0), BOXL(0, 2, 0, 1),
+};
+
+/* quadrants of U+2596 - U+259F: 1 upper left, 2 upper right, 4 lower left,
+ * 8 lower right */
+static const uchar boxquads[] = {4, 8, 1, 13, 9, 7, 11, 2, 6, 14};
+
+typedef struct {
+  pixman_region32_t region; /* relative to the top left of the cell */
+  uchar shade;              /* 0: solid, 1-3: quarters of fg over bg */
+  bool built;
+} Boxmask;
+
+static struct {
+  int cw, ch;
+  Boxmask mask[BOX_BLOCKS + BOX_BRAILLE];
+} boxcache;
+
+static void boxreset(void);
+static Boxmask *boxmask(Rune);
+static void boxlinemask(pixman_region32_t *, ushort);
 
 ssize_t xwrite(int fd, const char *s, size_t len) {
   size_t aux = len;
@@ -1416,6 +1737,7 @@ void tscrolldown(int orig, int n) {
   }
 
   selscroll(orig, n);
+  wlscroll(orig, term.bot, n);
 }
 
 void tscrollup(int orig, int n) {
@@ -1434,6 +1756,7 @@ void tscrollup(int orig, int n) {
   }
 
   selscroll(orig, -n);
+  wlscroll(orig, term.bot, -n);
 }
 
 void selscroll(int orig, int n) {
@@ -2704,17 +3027,69 @@ void wlresize(int col, int row) {
   wl.tw = MAX(1, col * wl.cw);
   wl.th = MAX(1, row * wl.ch);
 
-  wld.oldbuffer = wld.buffer;
-  wld.buffer = wld_create_buffer(wld.ctx, wl.w, wl.h, WLD_FORMAT_ARGB8888, 0);
+  /* the attached buffer lives until draw commits the new one, while one
+   * never committed can go right away */
+  if (wld.oldbuffer)
+    wld_buffer_unreference(wld.buffer);
+  else
+    wld.oldbuffer = wld.buffer;
+  wld.buffer = NULL;
+  /* renderers without 16-bit support fail to create it, so fall back */
+  if (rgb565 && wld_wayland_has_format(wld.ctx, WLD_FORMAT_RGB565))
+    wld.buffer =
+        wld_create_buffer(wld.ctx, wl.w, wl.h, WLD_FORMAT_RGB565, 0);
+  /* an alpha channel only when the background is translucent */
+  if (!wld.buffer)
+    wld.buffer = wld_create_buffer(wld.ctx, wl.w, wl.h,
+                                   term_alpha == 0xff ? WLD_FORMAT_XRGB8888
+                                                      : WLD_FORMAT_ARGB8888,
+                                   0);
 
   if (!wld.buffer)
     die("failed to create buffer");
+  wlsetopaque();
+  wld.rowhash = xrealloc(wld.rowhash, row * sizeof(*wld.rowhash));
+  memset(wld.rowhash, 0, row * sizeof(*wld.rowhash));
+  wld.drawn = xrealloc(wld.drawn, row * term.col * sizeof(*wld.drawn));
+  wld.rowbuf = xrealloc(wld.rowbuf, term.col * sizeof(*wld.rowbuf));
+  wld.pending = xrealloc(wld.pending, row * sizeof(*wld.pending));
+  memset(wld.pending, 0, row * sizeof(*wld.pending));
+  wld.scrolln = 0;
+  wld.cells = xrealloc(wld.cells, term.col * sizeof(*wld.cells));
   wld_export(wld.buffer, WLD_WAYLAND_OBJECT_BUFFER, &object);
   wl.buffer = object.ptr;
-  if (wld.oldbuffer) {
-    wld_buffer_unreference(wld.oldbuffer);
-    wld.oldbuffer = 0;
+
+  /* room for a wide character */
+  if (wld.curbuffer && wld.curbuffer->width == 2 * wl.cw &&
+      wld.curbuffer->height == wl.ch)
+    return;
+  if (wld.oldcurbuffer)
+    wld_buffer_unreference(wld.curbuffer);
+  else
+    wld.oldcurbuffer = wld.curbuffer;
+  wld.curbuffer =
+      wld_create_buffer(wld.ctx, 2 * wl.cw, wl.ch, WLD_FORMAT_ARGB8888, 0);
+  if (!wld.curbuffer)
+    die("failed to create cursor buffer");
+  wld_export(wld.curbuffer, WLD_WAYLAND_OBJECT_BUFFER, &object);
+  wl.curbuffer = object.ptr;
+}
+
+/*
+ * Declare the window opaque when its buffer has no alpha channel, so the
+ * compositor does not blend what is below it. Like the buffer format, this
+ * follows term_alpha at each resize.
+ */
+void wlsetopaque(void) {
+  struct wl_region *region = NULL;
+
+  if (wld.buffer->format != WLD_FORMAT_ARGB8888) {
+    region = wl_compositor_create_region(wl.cmp);
+    wl_region_add(region, 0, 0, wl.w, wl.h);
   }
+  wl_surface_set_opaque_region(wl.surface, region);
+  if (region)
+    wl_region_destroy(region);
 }
 
 uchar sixd_to_8bit(int x) { return x == 0 ? 0 : 0x37 + 0x28 * x; }
@@ -2747,6 +3122,7 @@ void wlloadcols(void) {
       else
         die("Could not allocate color %d\n", i);
     }
+  stylereset();
 }
 
 int wlsetcolorname(int x, const char *name) {
@@ -2759,6 +3135,7 @@ int wlsetcolorname(int x, const char *name) {
     return 1;
 
   dc.col[x] = color;
+  stylereset();
 
   return 0;
 }
@@ -2775,21 +3152,14 @@ static void wlloadcursor(void) {
   cursor.surface = wl_compositor_create_surface(wl.cmp);
 }
 
-void wltermclear(int col1, int row1, int col2, int row2) {
-  uint32_t color = dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg];
-  color = (color & term_alpha << 24) | (color & 0x00FFFFFF);
-  wld_fill_rectangle(wld.renderer, color, borderpx + col1 * wl.cw,
-                     borderpx + row1 * wl.ch, (col2 - col1 + 1) * wl.cw,
-                     (row2 - row1 + 1) * wl.ch);
-}
-
 /*
- * Absolute coordinates.
+ * Absolute coordinates. The area is queued with the other background spans
+ * and filled by bgflush().
  */
 void wlclear(int x1, int y1, int x2, int y2) {
   uint32_t color = dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg];
   color = (color & term_alpha << 24) | (color & 0x00FFFFFF);
-  wld_fill_rectangle(wld.renderer, color, x1, y1, x2 - x1, y2 - y1);
+  bgspan(color, x1, y1, x2 - x1, y2 - y1);
 }
 
 int wlloadfont(Font *f, FcPattern *pattern) {
@@ -2800,13 +3170,106 @@ int wlloadfont(Font *f, FcPattern *pattern) {
   if (!match)
     return 1;
 
+  if (wlopenfont(f, FcPatternDuplicate(pattern), match)) {
+    FcPatternDestroy(match);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Open the matched font; f takes the pattern. */
+int wlopenfont(Font *f, FcPattern *pattern, FcPattern *match) {
+  FcObjectSet *os;
+  FcPattern *name;
+  FcChar8 *matchname = NULL;
+
   if (!(f->match = wld_font_open_pattern(wld.fontctx, match))) {
+    FcPatternDestroy(pattern);
+    return 1;
+  }
+
+  if (fontcache) {
+    /* only what wld needs to open the font again */
+    os = FcObjectSetBuild(FC_FILE, FC_INDEX, FC_PIXEL_SIZE, FC_ASPECT,
+                          FC_ANTIALIAS, FC_HINTING, FC_HINT_STYLE, FC_AUTOHINT,
+                          (char *)0);
+    name = FcPatternFilter(match, os);
+    matchname = FcNameUnparse(name);
+    FcPatternDestroy(name);
+    FcObjectSetDestroy(os);
+  }
+  wlinitfont(f, pattern, matchname, 0);
+
+  return 0;
+}
+
+/*
+ * Derive a font with the given styles from the regular font, sharing its
+ * face; f takes the pattern.
+ */
+int wlderivefont(Font *f, FcPattern *pattern, int synth) {
+  FcChar8 *matchname = NULL;
+
+  if (!(f->match = wld_font_open_synthetic(dc.font.match, synth))) {
+    FcPatternDestroy(pattern);
+    return 1;
+  }
+  if (dc.font.matchname)
+    matchname = (FcChar8 *)xstrdup((char *)dc.font.matchname);
+  wlinitfont(f, pattern, matchname, synth);
+
+  return 0;
+}
+
+/*
+ * Load the font of a style, deriving it from the regular font if configured
+ * to or if fontconfig finds no face with the style.
+ */
+int wlloadstyle(Font *f, FcPattern *pattern, int style) {
+  FcPattern *match;
+  FcResult result;
+  FcBool embolden;
+  int slant, weight, missing = 0;
+
+  if (synthstyles)
+    return wlderivefont(f, FcPatternDuplicate(pattern), style);
+
+  if (!(match = FcFontMatch(NULL, pattern, &result)))
+    return 1;
+  if (style & WLD_FONT_ITALIC &&
+      FcPatternGetInteger(match, FC_SLANT, 0, &slant) == FcResultMatch &&
+      slant == FC_SLANT_ROMAN)
+    missing = 1;
+  if (style & WLD_FONT_BOLD &&
+      ((FcPatternGetInteger(match, FC_WEIGHT, 0, &weight) == FcResultMatch &&
+        weight < FC_WEIGHT_DEMIBOLD) ||
+       (FcPatternGetBool(match, FC_EMBOLDEN, 0, &embolden) == FcResultMatch &&
+        embolden)))
+    missing = 1;
+  if (missing) {
+    FcPatternDestroy(match);
+    return wlderivefont(f, FcPatternDuplicate(pattern), style);
+  }
+
+  if (wlopenfont(f, FcPatternDuplicate(pattern), match)) {
     FcPatternDestroy(match);
     return 1;
   }
 
-  f->set = NULL;
-  f->pattern = FcPatternDuplicate(pattern);
+  return 0;
+}
+
+/* Set up f for its opened font; f takes the pattern and the match name. */
+void wlinitfont(Font *f, FcPattern *pattern, FcChar8 *matchname, int synth) {
+  char path[PATH_MAX];
+
+  f->pattern = pattern;
+  f->cov.set = NULL;
+  f->cov.cover = NULL;
+  f->cov.len = -1;
+  f->matchname = matchname;
+  f->synth = synth;
 
   f->ascent = f->match->ascent;
   f->descent = f->match->descent;
@@ -2816,7 +3279,20 @@ int wlloadfont(Font *f, FcPattern *pattern) {
   f->height = f->ascent + f->descent;
   f->width = f->lbearing + f->rbearing;
 
-  return 0;
+  if (matchname && glyphcachepath(f, path, sizeof(path)) == 0)
+    wld_font_read_glyph_cache(f->match, path);
+}
+
+int glyphcachepath(Font *f, char *path, size_t size) {
+  char synth[16];
+  uint32_t key;
+
+  key = strhash(2166136261u, (char *)f->matchname);
+  if (f->synth) {
+    snprintf(synth, sizeof(synth), "\n*%d", f->synth);
+    key = strhash(key, synth);
+  }
+  return cachepath(path, size, "glyphs", key);
 }
 
 void wlloadfonts(char *fontstr, double fontsize) {
@@ -2824,6 +3300,13 @@ void wlloadfonts(char *fontstr, double fontsize) {
   double fontval;
   float ceilf(float);
 
+  prewarmreset();
+  if (fontcache && wlloadcachedfonts(fontstr, fontsize) == 0)
+    return;
+
+  if (!FcInit())
+    die("Could not init fontconfig.\n");
+
   if (fontstr[0] == '-') {
     /* XXX: need XftXlfdParse equivalent */
     pattern = NULL;
@@ -2876,38 +3359,281 @@ void wlloadfonts(char *fontstr, double fontsize) {
 
   FcPatternDel(pattern, FC_SLANT);
   FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-  if (wlloadfont(&dc.ifont, pattern))
+  if (wlloadstyle(&dc.ifont, pattern, WLD_FONT_ITALIC))
     die("%s: can't open font %s\n", argv0, fontstr);
 
   FcPatternDel(pattern, FC_WEIGHT);
   FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-  if (wlloadfont(&dc.ibfont, pattern))
+  if (wlloadstyle(&dc.ibfont, pattern, WLD_FONT_BOLD | WLD_FONT_ITALIC))
     die("%s: can't open font %s\n", argv0, fontstr);
 
   FcPatternDel(pattern, FC_SLANT);
   FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-  if (wlloadfont(&dc.bfont, pattern))
+  if (wlloadstyle(&dc.bfont, pattern, WLD_FONT_BOLD))
     die("%s: can't open font %s\n", argv0, fontstr);
 
   FcPatternDestroy(pattern);
+
+  if (fontcache)
+    wlsavecachedfonts(fontstr, fontsize);
+}
+
+/*
+ * The font cache file of a font string and size holds the font string and
+ * size it was saved for, as the key is only a hash of them, and the used font
+ * size. Then, for each of cachedfonts, the substituted pattern and the match
+ * follow on a line each. The match of a font derived from the regular one is
+ * '*' and the derived styles instead.
+ */
+uint32_t fontcachekey(char *fontstr, double fontsize) {
+  char size[32];
+
+  /* the version of the file's contents follows the size */
+  snprintf(size, sizeof(size), "\n%g\n3", fontsize);
+  return strhash(strhash(2166136261u, fontstr), size);
+}
+
+/* Open the fonts from the font cache, skipping fontconfig matching. */
+int wlloadcachedfonts(char *fontstr, double fontsize) {
+  FcPattern *pattern, *match;
+  FILE *fp;
+  char path[PATH_MAX], *line = NULL, *name = NULL;
+  size_t linesize = 0, namesize = 0;
+  double size;
+  float ceilf(float);
+  int i, ret = -1;
+
+  if (cachepath(path, sizeof(path), "fonts",
+                fontcachekey(fontstr, fontsize)) < 0 ||
+      !(fp = fopen(path, "r")))
+    return -1;
+
+  if (getline(&line, &linesize, fp) <= 0 ||
+      strcspn(line, "\n") != strlen(fontstr) ||
+      strncmp(line, fontstr, strlen(fontstr)) != 0)
+    goto done;
+  if (getline(&line, &linesize, fp) <= 0 ||
+      sscanf(line, "%lf", &size) != 1 || size != fontsize)
+    goto done;
+  if (getline(&line, &linesize, fp) <= 0 || sscanf(line, "%lf", &size) != 1)
+    goto done;
+
+  for (i = 0; i < LEN(cachedfonts); i++) {
+    if (getline(&name, &namesize, fp) <= 0 ||
+        getline(&line, &linesize, fp) <= 0)
+      break;
+    name[strcspn(name, "\n")] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+    pattern = FcNameParse((FcChar8 *)name);
+    if (line[0] == '*' && i > 0) {
+      if (!pattern || wlderivefont(cachedfonts[i], pattern, atoi(line + 1)))
+        break;
+      continue;
+    }
+    match = FcNameParse((FcChar8 *)line);
+    if (!pattern || !match) {
+      if (pattern)
+        FcPatternDestroy(pattern);
+      if (match)
+        FcPatternDestroy(match);
+      break;
+    }
+    if (wlopenfont(cachedfonts[i], pattern, match)) {
+      FcPatternDestroy(match);
+      break;
+    }
+  }
+  if (i < LEN(cachedfonts)) {
+    while (i > 0)
+      wlunloadfont(cachedfonts[--i]);
+    goto done;
+  }
+
+  usedfontsize = size;
+  if (fontsize <= 1)
+    defaultfontsize = usedfontsize;
+  wl.cw = ceilf(dc.font.width * cwscale);
+  wl.ch = ceilf(dc.font.height * chscale);
+  ret = 0;
+
+done:
+  free(line);
+  free(name);
+  fclose(fp);
+  return ret;
+}
+
+void wlsavecachedfonts(char *fontstr, double fontsize) {
+  FcChar8 *name;
+  FILE *fp;
+  char path[PATH_MAX], tmp[PATH_MAX];
+  int i, err;
+
+  for (i = 0; i < LEN(cachedfonts); i++) {
+    if (!cachedfonts[i]->matchname)
+      return;
+  }
+  if (cachepath(path, sizeof(path), "fonts",
+                fontcachekey(fontstr, fontsize)) < 0)
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  if (!(fp = fopen(tmp, "w")))
+    return;
+
+  fprintf(fp, "%s\n%.17g\n%.17g\n", fontstr, fontsize, usedfontsize);
+  for (i = 0; i < LEN(cachedfonts); i++) {
+    if ((name = FcNameUnparse(cachedfonts[i]->pattern))) {
+      fprintf(fp, "%s\n", (char *)name);
+      free(name);
+    }
+    if (cachedfonts[i]->synth)
+      fprintf(fp, "*%d\n", cachedfonts[i]->synth);
+    else
+      fprintf(fp, "%s\n", (char *)cachedfonts[i]->matchname);
+  }
+  err = ferror(fp);
+  if (fclose(fp) != 0 || err || rename(tmp, path) < 0)
+    unlink(tmp);
+}
+
+/*
+ * Save the glyphs rasterized for the current fonts, together with printable
+ * ASCII and Latin-1, for the next start.
+ */
+void wlsaveglyphs(void) {
+  struct wld_font *f;
+  char path[PATH_MAX];
+  Rune u;
+  int i;
+
+  for (i = 0; i < LEN(cachedfonts); i++) {
+    if (!cachedfonts[i]->matchname ||
+        glyphcachepath(cachedfonts[i], path, sizeof(path)) < 0)
+      continue;
+    f = cachedfonts[i]->match;
+    for (u = 0x20; u < 0x100; u++) {
+      if (u < 0x7f || u >= 0xa0)
+        wld_font_ensure_char(f, u);
+    }
+    wld_font_write_glyph_cache(f, path);
+  }
+}
+
+void prewarmreset(void) {
+  prewarm.active = LEN(prewarmranges) > 0;
+  prewarm.font = 0;
+  prewarm.range = 0;
+  prewarm.next = prewarm.active ? prewarmranges[0][0] : 0;
+}
+
+/*
+ * Rasterize the next few characters of prewarmranges. This runs on the main
+ * thread between events, since the fonts are not safe to use from another
+ * one, in slices short enough not to delay input.
+ */
+void prewarmstep(void) {
+  int n;
+
+  for (n = 0; n < 32 && prewarm.active; n++) {
+    wld_font_ensure_char(cachedfonts[prewarm.font]->match, prewarm.next);
+    if (prewarm.next++ < prewarmranges[prewarm.range][1])
+      continue;
+    if (++prewarm.range == LEN(prewarmranges)) {
+      prewarm.range = 0;
+      if (++prewarm.font == LEN(cachedfonts)) {
+        prewarm.active = 0;
+        break;
+      }
+    }
+    prewarm.next = prewarmranges[prewarm.range][0];
+  }
 }
 
 void wlunloadfont(Font *f) {
   wld_font_close(f->match);
   FcPatternDestroy(f->pattern);
-  if (f->set)
-    FcFontSetDestroy(f->set);
+  coverfree(&f->cov);
+  free(f->matchname);
 }
 
+/*
+ * Keep the main and fallback fonts around for a later zoom back to their
+ * size. The codepoints are mapped to fallback fonts again at the new size.
+ */
 void wlunloadfonts(void) {
-  /* Free the loaded fonts in the font cache.  */
-  while (frclen > 0)
-    wld_font_close(frc[--frclen].font);
+  fallbackdrain();
+
+  memset(fallback, 0, sizeof(fallback));
+  fallbacklen = 0;
+
+  wlstashfonts();
+}
+
+void wlstashfonts(void) {
+  Fontsize *fs = NULL;
+  int i;
+
+  for (i = 0; i < fontsizeslen; i++) {
+    if (fontsizes[i].size == usedfontsize)
+      fs = &fontsizes[i];
+  }
+  if (!fs && fontsizeslen < LEN(fontsizes)) {
+    fs = &fontsizes[fontsizeslen++];
+  } else {
+    /* replace the fonts kept for this size or the least recently used ones */
+    if (!fs) {
+      for (fs = &fontsizes[0], i = 1; i < fontsizeslen; i++) {
+        if (fontsizes[i].used < fs->used)
+          fs = &fontsizes[i];
+      }
+    }
+    wlunloadfont(&fs->font);
+    wlunloadfont(&fs->bfont);
+    wlunloadfont(&fs->ifont);
+    wlunloadfont(&fs->ibfont);
+    while (fs->frclen > 0) {
+      wld_font_close(fs->frc[--fs->frclen].font);
+      free(fs->frc[fs->frclen].file);
+    }
+  }
+
+  fs->size = usedfontsize;
+  fs->font = dc.font;
+  fs->bfont = dc.bfont;
+  fs->ifont = dc.ifont;
+  fs->ibfont = dc.ibfont;
+  memcpy(fs->frc, frc, frclen * sizeof(*frc));
+  fs->frclen = frclen;
+  frclen = 0;
+  fs->cw = wl.cw;
+  fs->ch = wl.ch;
+  fs->used = ++fontsizesclock;
+}
+
+/* Make the fonts of the given size current, if they were kept. */
+int wlunstashfonts(double size) {
+  int i;
+
+  for (i = 0; i < fontsizeslen; i++) {
+    if (fontsizes[i].size == size)
+      break;
+  }
+  if (i == fontsizeslen)
+    return 0;
 
-  wlunloadfont(&dc.font);
-  wlunloadfont(&dc.bfont);
-  wlunloadfont(&dc.ifont);
-  wlunloadfont(&dc.ibfont);
+  dc.font = fontsizes[i].font;
+  dc.bfont = fontsizes[i].bfont;
+  dc.ifont = fontsizes[i].ifont;
+  dc.ibfont = fontsizes[i].ibfont;
+  memcpy(frc, fontsizes[i].frc, fontsizes[i].frclen * sizeof(*frc));
+  frclen = fontsizes[i].frclen;
+  wl.cw = fontsizes[i].cw;
+  wl.ch = fontsizes[i].ch;
+  usedfontsize = size;
+  fontsizes[i] = fontsizes[--fontsizeslen];
+  prewarmreset();
+
+  return 1;
 }
 
 void wlzoom(const Arg *arg) {
@@ -2919,7 +3645,9 @@ void wlzoom(const Arg *arg) {
 
 void wlzoomabs(const Arg *arg) {
   wlunloadfonts();
-  wlloadfonts(usedfont, arg->f);
+  /* a size of at most 1 loads the fonts at their default size */
+  if (!wlunstashfonts(arg->f <= 1 ? defaultfontsize : arg->f))
+    wlloadfonts(usedfont, arg->f);
   cresize(0, 0);
   redraw();
   /* XXX: Should the window size be updated here because wayland doesn't
@@ -2939,6 +3667,7 @@ void wlzoomreset(const Arg *arg) {
 
 void wlinit(void) {
   struct wl_registry *registry;
+  struct wl_region *region;
 
   if (!(wl.dpy = wl_display_connect(NULL)))
     die("Can't open display\n");
@@ -2946,25 +3675,35 @@ void wlinit(void) {
   registry = wl_display_get_registry(wl.dpy);
   wl_registry_add_listener(registry, &reglistener, NULL);
 
-  wl_display_dispatch(wl.dpy);
+  /* the only roundtrip before the first configure, see regglobal */
   wl_display_roundtrip(wl.dpy);
 
-  wld.ctx = wld_wayland_create_context(wl.dpy, WLD_ANY);
+  /* wl_drm is bound from our registry, saving wld a roundtrip of its own */
+  if (usedrm && wl.drm)
+    wld.ctx = wld_wayland_create_drm_context(wl.dpy, registry, wl.drm,
+                                             wl.drmversion);
+  if (!wld.ctx)
+    wld.ctx = wld.shmctx;
+
+  if (!wl.shm)
+    die("Display has no SHM\n");
   if (!wld.ctx)
     die("Can't create wayland context\n");
   wld.renderer = wld_create_renderer(wld.ctx);
-  if (!wld.ctx || !wld.renderer)
+  if (!wld.renderer)
     die("Can't create renderer\n");
-  if (!wl.shm)
-    die("Display has no SHM\n");
+  wlrecord(getenv("WTERM_DISPLAY_LIST"));
+  /* the renderer records what it draws, see wlsubmitdamage */
+  wld.renderer->track_damage = true;
   if (!wl.seat)
     die("Display has no seat\n");
   if (!wl.datadevmanager)
     die("Display has no data device manager\n");
+  if (!wl.subcmp)
+    die("Display has no subcompositor\n");
 
   wl.xkb.ctx = xkb_context_new(0);
 
-  wl_display_roundtrip(wl.dpy);
   wl.keyboard = wl_seat_get_keyboard(wl.seat);
   if (!wl.keyboard)
     die("Display has no keyboard\n");
@@ -2976,11 +3715,11 @@ void wlinit(void) {
   wl_data_device_add_listener(wl.datadev, &datadevlistener, NULL);
 
   /* font */
-  if (!FcInit())
-    die("Could not init fontconfig.\n");
-
   usedfont = (opt_font == NULL) ? font : opt_font;
   wld.fontctx = wld_font_create_context();
+  if (pipe(fbw.pipe) < 0 || fcntl(fbw.pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(fbw.pipe[1], F_SETFL, O_NONBLOCK) < 0)
+    die("pipe failed: %s\n", strerror(errno));
   wlloadfonts(usedfont, 0);
 
   wlloadcols();
@@ -3001,77 +3740,834 @@ void wlinit(void) {
       die("failed to get xdgsurface");
   } else
     die("no wayland shell");
+
+  /* the cursor never takes input, so give it an empty input region */
+  wl.cursurface = wl_compositor_create_surface(wl.cmp);
+  wl.cursubsurf =
+      wl_subcompositor_get_subsurface(wl.subcmp, wl.cursurface, wl.surface);
+  region = wl_compositor_create_region(wl.cmp);
+  wl_surface_set_input_region(wl.cursurface, region);
+  wl_region_destroy(region);
+
   wl_surface_commit(wl.surface);
   wlresettitle();
+
+  /* run in reverse, so the stats leave out the glyphs saved */
+  if (fontcache)
+    atexit(wlsaveglyphs);
+  if (getenv("WTERM_DEBUG"))
+    atexit(dumpstats);
 }
 
 /*
- * TODO: Implement something like XftDrawGlyphFontSpec in wld, and then apply a
- * similar patch to ae1923d27533ff46400d93765e971558201ca1ee
+ * With a path, draw through a recorder that replays each frame with the
+ * renderer and dumps its display list to the file, for profiling.
  */
+void wlrecord(const char *path) {
+  struct wld_renderer *recorder;
 
-void wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
-  int winx = borderpx + x * wl.cw, winy = borderpx + y * wl.ch,
-      width = charlen * wl.cw, xp, i;
-  int frcflags, charexists;
-  int u8fl, u8fblen, u8cblen, doesexist;
-  char *u8c, *u8fs;
-  Rune unicodep;
-  Font *font = &dc.font;
-  FcResult fcres;
-  FcPattern *fcpattern, *fontpattern;
-  FcFontSet *fcsets[] = {NULL};
-  FcCharSet *fccharset;
-  uint32_t fg, bg, temp;
-  int oneatatime;
-
-  frcflags = FRC_NORMAL;
+  if (!path || !*path)
+    return;
+  if (!(wld.listfile = fopen(path, "w")))
+    die("can't open %s: %s\n", path, strerror(errno));
+  if (!(recorder = wld_create_recorder(wld.renderer)))
+    die("Can't create recorder\n");
+  wld.renderer = recorder;
+}
 
-  if (base.mode & ATTR_ITALIC) {
-    if (base.fg == defaultfg)
-      base.fg = defaultitalic;
-    font = &dc.ifont;
-    frcflags = FRC_ITALIC;
-  } else if ((base.mode & ATTR_ITALIC) && (base.mode & ATTR_BOLD)) {
-    if (base.fg == defaultfg)
-      base.fg = defaultitalic;
-    font = &dc.ibfont;
-    frcflags = FRC_ITALICBOLD;
-  } else if (base.mode & ATTR_UNDERLINE) {
-    if (base.fg == defaultfg)
-      base.fg = defaultunderline;
-  }
+void wldumpframe(void) {
+  struct wld_display_list *list;
+  struct timespec now;
 
-  if (IS_TRUECOL(base.fg)) {
-    fg = base.fg;
-  } else {
-    fg = dc.col[base.fg];
-  }
+  if (!(list = wld_recorder_take(wld.renderer)))
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(wld.listfile, "frame %ld.%09ld\n", (long)now.tv_sec, now.tv_nsec);
+  wld_display_list_dump(list, wld.listfile);
+  fflush(wld.listfile);
+  wld_destroy_display_list(list);
+}
 
-  if (IS_TRUECOL(base.bg)) {
-    bg = base.bg | 0xff000000;
-  } else {
-    bg = dc.col[base.bg];
+/*
+ * Damage the surface with what the renderer drew into the buffer since the
+ * last call, in buffer coordinates when the compositor takes them, and return
+ * whether there was any.
+ */
+int wlsubmitdamage(struct wl_surface *surface, struct wld_buffer *buffer) {
+  pixman_box32_t *box;
+  int n, damaged;
+
+  box = pixman_region32_rectangles(&buffer->damage, &n);
+  damaged = n > 0;
+  for (; n > 0; n--, box++) {
+    if (wl_surface_get_version(surface) >=
+        WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+      wl_surface_damage_buffer(surface, box->x1, box->y1,
+                               box->x2 - box->x1, box->y2 - box->y1);
+    else
+      wl_surface_damage(surface, box->x1, box->y1, box->x2 - box->x1,
+                        box->y2 - box->y1);
   }
+  pixman_region32_clear(&buffer->damage);
+  return damaged;
+}
 
-  if (base.mode & ATTR_BOLD) {
-    /*
-     * change basic system colors [0-7]
-     * to bright system colors [8-15]
-     */
-    if (BETWEEN(base.fg, 0, 7) && !(base.mode & ATTR_FAINT))
-      fg = dc.col[base.fg + 8];
+void boxreset(void) {
+  int i;
 
-    if (base.mode & ATTR_ITALIC) {
-      font = &dc.ibfont;
-      frcflags = FRC_ITALICBOLD;
-    } else {
-      font = &dc.bfont;
-      frcflags = FRC_BOLD;
-    }
+  for (i = 0; i < LEN(boxcache.mask); i++) {
+    if (boxcache.mask[i].built)
+      pixman_region32_fini(&boxcache.mask[i].region);
+    boxcache.mask[i].built = false;
   }
+  boxcache.cw = wl.cw;
+  boxcache.ch = wl.ch;
+}
 
-  if (IS_SET(MODE_REVERSE)) {
+static void boxrect(pixman_region32_t *r, int x, int y, int w, int h) {
+  if (w > 0 && h > 0)
+    pixman_region32_union_rect(r, r, x, y, w, h);
+}
+
+/*
+ * Lines are centered in the cell. Light lines are about an eighth of the cell
+ * width, heavy lines a bit more than twice that, and the two strokes of a
+ * double line are one light line width apart.
+ */
+void boxlinemask(pixman_region32_t *r, ushort b) {
+  int w = wl.cw, h = wl.ch, cx = w / 2, cy = h / 2;
+  int lw = MAX(1, (w + 4) / 8), hw = 2 * lw + 1, g = lw;
+  int t[4], a[4], i, n, p0, p1, gap, vt, ht, dh, dv;
+
+  for (i = 0; i < 4; i++) {
+    a[i] = BOXARM(b, i);
+    t[i] = a[i] == BOX_HEAVY ? hw : a[i] == BOX_LIGHT ? lw : 0;
+  }
+  /* thickness of the single lines crossing the center */
+  ht = MAX(t[0], t[2]);
+  vt = MAX(t[1], t[3]);
+  /* whether a double line comes in horizontally or vertically */
+  dh = a[0] == BOX_DOUBLE || a[2] == BOX_DOUBLE;
+  dv = a[1] == BOX_DOUBLE || a[3] == BOX_DOUBLE;
+
+  if (b & (BOX_DIAGR | BOX_DIAGL)) {
+    for (i = 0; i < h; i++) {
+      p0 = i * w / h;
+      p1 = MAX(p0 + 1, ((i + 1) * w + h - 1) / h) + lw - 1;
+      if (b & BOX_DIAGL)
+        boxrect(r, p0, i, p1 - p0, 1);
+      if (b & BOX_DIAGR)
+        boxrect(r, w - p1, i, p1 - p0, 1);
+    }
+    return;
+  }
+
+  if (b >> 8) {
+    n = BOXDASHES(b);
+    for (i = 0; i < n; i++) {
+      if (a[0]) {
+        p0 = i * w / n, p1 = (i + 1) * w / n;
+        gap = MAX(1, (p1 - p0) / 3);
+        boxrect(r, p0, cy - t[0] / 2, p1 - p0 - gap, t[0]);
+      } else {
+        p0 = i * h / n, p1 = (i + 1) * h / n;
+        gap = MAX(1, (p1 - p0) / 3);
+        boxrect(r, cx - t[1] / 2, p0, t[1], p1 - p0 - gap);
+      }
+    }
+    return;
+  }
+
+  /* left arm, p1 is where it ends */
+  if (a[0] == BOX_DOUBLE) {
+    p0 = a[1] == BOX_DOUBLE ? cx - g : a[3] == BOX_DOUBLE ? cx + g : cx;
+    p1 = a[3] == BOX_DOUBLE ? cx - g : a[1] == BOX_DOUBLE ? cx + g : cx;
+    p0 += dv ? lw - lw / 2 : vt - vt / 2;
+    p1 += dv ? lw - lw / 2 : vt - vt / 2;
+    boxrect(r, 0, cy - g - lw / 2, p0, lw);
+    boxrect(r, 0, cy + g - lw / 2, p1, lw);
+  } else if (a[0]) {
+    if (a[2] || !dv)
+      p1 = cx - vt / 2 + vt;
+    else if (a[1] == BOX_DOUBLE && a[3] == BOX_DOUBLE)
+      p1 = cx - g - lw / 2 + lw;
+    else
+      p1 = cx + g - lw / 2 + lw;
+    boxrect(r, 0, cy - t[0] / 2, MAX(p1, cx), t[0]);
+  }
+
+  /* right arm, p0 is where it starts */
+  if (a[2] == BOX_DOUBLE) {
+    p0 = a[1] == BOX_DOUBLE ? cx + g : a[3] == BOX_DOUBLE ? cx - g : cx;
+    p1 = a[3] == BOX_DOUBLE ? cx + g : a[1] == BOX_DOUBLE ? cx - g : cx;
+    p0 -= dv ? lw / 2 : vt / 2;
+    p1 -= dv ? lw / 2 : vt / 2;
+    boxrect(r, p0, cy - g - lw / 2, w - p0, lw);
+    boxrect(r, p1, cy + g - lw / 2, w - p1, lw);
+  } else if (a[2]) {
+    if (a[0] || !dv)
+      p0 = a[0] ? cx : cx - vt / 2;
+    else if (a[1] == BOX_DOUBLE && a[3] == BOX_DOUBLE)
+      p0 = cx + g - lw / 2;
+    else
+      p0 = cx - g - lw / 2;
+    boxrect(r, p0, cy - t[2] / 2, w - p0, t[2]);
+  }
+
+  /* up arm, p1 is where it ends */
+  if (a[1] == BOX_DOUBLE) {
+    p0 = a[0] == BOX_DOUBLE ? cy - g : a[2] == BOX_DOUBLE ? cy + g : cy;
+    p1 = a[2] == BOX_DOUBLE ? cy - g : a[0] == BOX_DOUBLE ? cy + g : cy;
+    p0 += dh ? lw - lw / 2 : ht - ht / 2;
+    p1 += dh ? lw - lw / 2 : ht - ht / 2;
+    boxrect(r, cx - g - lw / 2, 0, lw, p0);
+    boxrect(r, cx + g - lw / 2, 0, lw, p1);
+  } else if (a[1]) {
+    if (a[3] || !dh)
+      p1 = cy - ht / 2 + ht;
+    else if (a[0] == BOX_DOUBLE && a[2] == BOX_DOUBLE)
+      p1 = cy - g - lw / 2 + lw;
+    else
+      p1 = cy + g - lw / 2 + lw;
+    boxrect(r, cx - t[1] / 2, 0, t[1], MAX(p1, cy));
+  }
+
+  /* down arm, p0 is where it starts */
+  if (a[3] == BOX_DOUBLE) {
+    p0 = a[0] == BOX_DOUBLE ? cy + g : a[2] == BOX_DOUBLE ? cy - g : cy;
+    p1 = a[2] == BOX_DOUBLE ? cy + g : a[0] == BOX_DOUBLE ? cy - g : cy;
+    p0 -= dh ? lw / 2 : ht / 2;
+    p1 -= dh ? lw / 2 : ht / 2;
+    boxrect(r, cx - g - lw / 2, p0, lw, h - p0);
+    boxrect(r, cx + g - lw / 2, p1, lw, h - p1);
+  } else if (a[3]) {
+    if (a[1] || !dh)
+      p0 = a[1] ? cy : cy - ht / 2;
+    else if (a[0] == BOX_DOUBLE && a[2] == BOX_DOUBLE)
+      p0 = cy + g - lw / 2;
+    else
+      p0 = cy - g - lw / 2;
+    boxrect(r, cx - t[3] / 2, p0, t[3], h - p0);
+  }
+}
+
+/* Returns the mask of a box-drawing character, building it if needed. */
+Boxmask *boxmask(Rune u) {
+  int w = wl.cw, h = wl.ch, i, n, q, dx, dy, d;
+  Boxmask *m;
+  pixman_region32_t *r;
+
+  if (boxcache.cw != wl.cw || boxcache.ch != wl.ch)
+    boxreset();
+
+  m = &boxcache.mask[u >= 0x2800 ? BOX_BLOCKS + u - 0x2800 : u - 0x2500];
+  if (m->built)
+    return m;
+
+  r = &m->region;
+  pixman_region32_init(r);
+  m->shade = 0;
+  m->built = true;
+
+/* n eighths of the cell width or height */
+#define EIGHTHS(s, n) (((s) * (n) + 4) / 8)
+
+  if (u < 0x2580) {
+    boxlinemask(r, boxlines[u - 0x2500]);
+  } else if (u == 0x2580) { /* ▀ */
+    boxrect(r, 0, 0, w, EIGHTHS(h, 4));
+  } else if (u <= 0x2588) { /* ▁ ... █ */
+    n = 8 - (u - 0x2580);
+    boxrect(r, 0, EIGHTHS(h, n), w, h - EIGHTHS(h, n));
+  } else if (u <= 0x258F) { /* ▉ ... ▏ */
+    boxrect(r, 0, 0, EIGHTHS(w, 8 - (u - 0x2588)), h);
+  } else if (u == 0x2590) { /* ▐ */
+    boxrect(r, EIGHTHS(w, 4), 0, w - EIGHTHS(w, 4), h);
+  } else if (u <= 0x2593) { /* ░ ▒ ▓ */
+    boxrect(r, 0, 0, w, h);
+    m->shade = u - 0x2590;
+  } else if (u == 0x2594) { /* ▔ */
+    boxrect(r, 0, 0, w, EIGHTHS(h, 1));
+  } else if (u == 0x2595) { /* ▕ */
+    boxrect(r, EIGHTHS(w, 7), 0, w - EIGHTHS(w, 7), h);
+  } else if (u <= 0x259F) { /* ▖ ... ▟ */
+    q = boxquads[u - 0x2596];
+    dx = EIGHTHS(w, 4);
+    dy = EIGHTHS(h, 4);
+    if (q & 1)
+      boxrect(r, 0, 0, dx, dy);
+    if (q & 2)
+      boxrect(r, dx, 0, w - dx, dy);
+    if (q & 4)
+      boxrect(r, 0, dy, dx, h - dy);
+    if (q & 8)
+      boxrect(r, dx, dy, w - dx, h - dy);
+  } else { /* braille: dots 1-3 and 7 on the left, 4-6 and 8 on the right */
+    d = MAX(1, MIN(w / 2, h / 4) / 2);
+    for (i = 0; i < 8; i++) {
+      if (!((u - 0x2800) & 1 << i))
+        continue;
+      dx = (i < 3 || i == 6) ? 0 : 1;
+      dy = i < 6 ? i % 3 : 3;
+      boxrect(r, dx * w / 2 + (w / 2 - d) / 2, dy * h / 4 + (h / 4 - d) / 2,
+              d, d);
+    }
+  }
+
+#undef EIGHTHS
+
+  pixman_region32_intersect_rect(r, r, 0, 0, w, h);
+  return m;
+}
+
+/*
+ * Absolute coordinates. The cell background has already been filled with bg,
+ * which is only needed to blend the shade characters.
+ */
+void wldrawbox(Rune u, int x, int y, uint32_t fg, uint32_t bg) {
+  Boxmask *m = boxmask(u);
+  uint32_t color = fg;
+  int i, s;
+
+  if (m->shade) {
+    for (color = 0, i = 0; i < 32; i += 8) {
+      s = (((fg >> i) & 0xff) * m->shade + ((bg >> i) & 0xff) * (4 - m->shade));
+      color |= (uint32_t)(s / 4) << i;
+    }
+  }
+
+  pixman_region32_translate(&m->region, x, y);
+  wld_fill_region(wld.renderer, color, &m->region);
+  pixman_region32_translate(&m->region, -x, -y);
+}
+
+/*
+ * Returns the index in frc of the fallback font to draw u with, -1 if no font
+ * has it, or FALLBACK_PENDING if the worker has yet to find out.
+ */
+int fallbackfont(Font *font, Rune u, int flags) {
+  Fallback *e;
+  Fallbackjob *job;
+  uint h;
+  int err;
+  bool full;
+
+  if (fallbacklen >= LEN(fallback) * 3 / 4) {
+    memset(fallback, 0, sizeof(fallback));
+    fallbacklen = 0;
+  }
+
+  h = (u * 2654435761u + flags) % LEN(fallback);
+  for (e = &fallback[h]; e->used; e = &fallback[h]) {
+    if (e->u == u && e->flags == flags)
+      break;
+    h = (h + 1) % LEN(fallback);
+  }
+
+  if (e->used) {
+    if (e->font == FALLBACK_PENDING) {
+      stats.fallbackpending++;
+      return FALLBACK_PENDING;
+    }
+    if (e->font < 0) {
+      stats.fallbacknone++;
+      return -1;
+    }
+    if (frc[e->font].gen == e->gen) {
+      stats.fallbackhits++;
+      frc[e->font].used = ++frcclock;
+      return e->font;
+    }
+    /* the font was closed in the meantime */
+  }
+
+  stats.fallbackmisses++;
+  pthread_mutex_lock(&fbw.lock);
+  /* every job must find room among the done ones */
+  full = fbw.njobs + fbw.ndone + fbw.busy >= LEN(fbw.jobs);
+  if (!full) {
+    job = &fbw.jobs[fbw.njobs++];
+    job->font = font;
+    job->u = u;
+    job->flags = flags;
+    if (!fbw.started) {
+      if ((err = pthread_create(&fbw.thread, NULL, fallbackworker, NULL)))
+        die("pthread_create failed: %s\n", strerror(err));
+      fbw.started = true;
+    }
+    pthread_cond_broadcast(&fbw.cond);
+  }
+  pthread_mutex_unlock(&fbw.lock);
+
+  /* with the queue full, ask again on the next draw */
+  if (full)
+    return FALLBACK_PENDING;
+  if (!e->used) {
+    e->used = true;
+    e->u = u;
+    e->flags = flags;
+    fallbacklen++;
+  }
+  e->font = FALLBACK_PENDING;
+  return FALLBACK_PENDING;
+}
+
+void *fallbackworker(void *arg) {
+  Fallbackjob job;
+
+  pthread_mutex_lock(&fbw.lock);
+  for (;;) {
+    while (fbw.njobs == 0) {
+      fbw.busy = false;
+      pthread_cond_broadcast(&fbw.cond);
+      pthread_cond_wait(&fbw.cond, &fbw.lock);
+    }
+    job = fbw.jobs[--fbw.njobs];
+    fbw.busy = true;
+    pthread_mutex_unlock(&fbw.lock);
+
+    fallbackresolve(&job);
+
+    pthread_mutex_lock(&fbw.lock);
+    fbw.done[fbw.ndone++] = job;
+    if (write(fbw.pipe[1], "", 1) < 0 && errno != EAGAIN)
+      fprintf(stderr, "fallback worker: %s\n", strerror(errno));
+  }
+  return NULL;
+}
+
+/*
+ * Runs on the worker. Find the first font of the style's fallback set that
+ * has job->u, and open it unless a fallback font with the same face is open
+ * already. The coverage of the style is built on the first fallback into the
+ * job, and published by fallbackdone.
+ */
+void fallbackresolve(Fallbackjob *job) {
+  Font *font = job->font;
+  FcPattern *setfont, *pattern;
+  FcChar8 *file;
+  Coverset cov;
+  int i, j;
+
+  job->slot = -1;
+  job->match = NULL;
+  job->file = NULL;
+  job->cov.len = -1;
+
+  /* the coverage may also be in a job yet to be published */
+  pthread_mutex_lock(&fbw.lock);
+  cov = font->cov;
+  for (i = 0; cov.len < 0 && i < fbw.ndone; i++) {
+    if (fbw.done[i].font == font)
+      cov = fbw.done[i].cov;
+  }
+  pthread_mutex_unlock(&fbw.lock);
+  if (cov.len < 0) {
+    coverbuild(&job->cov, font->pattern);
+    cov = job->cov;
+  }
+
+  if ((j = coverfind(&cov, job->u)) < 0)
+    return;
+  setfont = cov.set->fonts[j];
+
+  if (FcPatternGetString(setfont, FC_FILE, 0, &file) != FcResultMatch)
+    file = (FcChar8 *)"";
+  if (FcPatternGetInteger(setfont, FC_INDEX, 0, &job->index) != FcResultMatch)
+    job->index = 0;
+
+  pthread_mutex_lock(&fbw.lock);
+  for (i = 0; i < frclen; i++) {
+    if (frc[i].index == job->index && strcmp(frc[i].file, (char *)file) == 0) {
+      job->slot = i;
+      job->gen = frc[i].gen;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fbw.lock);
+  if (job->slot >= 0)
+    return;
+
+  if (!(pattern = FcFontRenderPrepare(NULL, font->pattern, setfont)))
+    return;
+  job->match = wld_font_open_pattern(wld.fontctx, pattern);
+  FcPatternDestroy(pattern);
+  if (job->match && !wld_font_ensure_char(job->match, job->u)) {
+    wld_font_close(job->match);
+    job->match = NULL;
+  }
+  if (job->match)
+    job->file = xstrdup((char *)file);
+}
+
+/*
+ * Take the results of the worker: the coverage is kept with its font, new
+ * fonts are put in frc, the codepoints are mapped to them and rows that
+ * were drawn with placeholders are redrawn.
+ */
+void fallbackdone(void) {
+  Fallbackjob *job;
+  Fallback *e;
+  /* fonts to close once the worker can go on */
+  struct wld_font *unused[LEN(fbw.done)];
+  char buf[64];
+  uint h;
+  int i, j, y, nunused = 0;
+
+  while (read(fbw.pipe[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&fbw.lock);
+  while (fbw.ndone > 0) {
+    job = &fbw.done[--fbw.ndone];
+
+    if (job->cov.len >= 0) {
+      if (job->font->cov.len < 0)
+        job->font->cov = job->cov;
+      else
+        coverfree(&job->cov);
+    }
+
+    if (job->match) {
+      for (i = 0; i < frclen; i++) {
+        if (frc[i].index == job->index && strcmp(frc[i].file, job->file) == 0)
+          break;
+      }
+
+      if (i < frclen) {
+        /* found twice */
+        unused[nunused++] = job->match;
+        free(job->file);
+      } else {
+        /* Overwrite the least recently used entry or create a new one. */
+        if (frclen >= LEN(frc)) {
+          for (i = 0, j = 1; j < frclen; j++) {
+            if (frc[j].used < frc[i].used)
+              i = j;
+          }
+          unused[nunused++] = frc[i].font;
+          free(frc[i].file);
+          frc[i].gen++;
+        } else {
+          frclen++;
+        }
+        frc[i].font = job->match;
+        frc[i].file = job->file;
+        frc[i].index = job->index;
+        frc[i].used = ++frcclock;
+      }
+      job->slot = i;
+      job->gen = frc[i].gen;
+    }
+
+    if (fallbacklen >= LEN(fallback) * 3 / 4) {
+      memset(fallback, 0, sizeof(fallback));
+      fallbacklen = 0;
+    }
+    h = (job->u * 2654435761u + job->flags) % LEN(fallback);
+    for (e = &fallback[h]; e->used; e = &fallback[h]) {
+      if (e->u == job->u && e->flags == job->flags)
+        break;
+      h = (h + 1) % LEN(fallback);
+    }
+    if (!e->used) {
+      e->used = true;
+      e->u = job->u;
+      e->flags = job->flags;
+      fallbacklen++;
+    }
+    e->font = job->slot;
+    e->gen = job->gen;
+  }
+  pthread_mutex_unlock(&fbw.lock);
+  while (nunused > 0)
+    wld_font_close(unused[--nunused]);
+
+  for (y = 0; y < term.row; y++) {
+    if (!wld.pending[y])
+      continue;
+    wld.pending[y] = 0;
+    wld.rowhash[y] = 0;
+    term.dirty[y] = 1;
+    needdraw = true;
+  }
+}
+
+/*
+ * Drop the queued jobs and wait for the worker to go idle, so the fonts can
+ * be closed.
+ */
+void fallbackdrain(void) {
+  Fallbackjob *job;
+
+  pthread_mutex_lock(&fbw.lock);
+  fbw.njobs = 0;
+  while (fbw.busy)
+    pthread_cond_wait(&fbw.cond, &fbw.lock);
+  for (; fbw.ndone > 0; fbw.ndone--) {
+    job = &fbw.done[fbw.ndone - 1];
+    if (job->match) {
+      wld_font_close(job->match);
+      free(job->file);
+    }
+    if (job->cov.len >= 0)
+      coverfree(&job->cov);
+  }
+  pthread_mutex_unlock(&fbw.lock);
+}
+
+/*
+ * Build the index of which font of the style's sorted fallback set is the
+ * first to cover each codepoint, so that finding a fallback font needs no
+ * fontconfig matching. The index is saved in the cache directory under a
+ * name derived from the fonts in the set, so it is rebuilt whenever the
+ * installed fonts change.
+ */
+void coverbuild(Coverset *f, FcPattern *pattern) {
+  FcResult fcres;
+  FcChar32 map[FC_CHARSET_MAP_SIZE], next, base;
+  FcCharSet *charset;
+  FcChar8 *file;
+  uint32_t key = 2166136261u;
+  short *owner;
+  char path[PATH_MAX];
+  int i, j, k, n, cap;
+  Rune u;
+
+  f->cover = NULL;
+  f->len = 0;
+  if (!(f->set = FcFontSort(0, pattern, 1, 0, &fcres)))
+    return;
+
+  for (i = 0; i < f->set->nfont; i++) {
+    if (FcPatternGetString(f->set->fonts[i], FC_FILE, 0, &file) ==
+        FcResultMatch) {
+      for (; *file; file++)
+        key = (key ^ *file) * 16777619;
+    }
+    if (FcPatternGetInteger(f->set->fonts[i], FC_INDEX, 0, &k) ==
+        FcResultMatch)
+      key = (key ^ k) * 16777619;
+    if (FcPatternGetInteger(f->set->fonts[i], FC_FONTVERSION, 0, &k) ==
+        FcResultMatch)
+      key = (key ^ k) * 16777619;
+    key = (key ^ '\n') * 16777619;
+  }
+
+  if (cachepath(path, sizeof(path), "coverage", key) < 0)
+    path[0] = '\0';
+  else if (coverload(f, path) == 0)
+    return;
+
+  /* the first font covering each codepoint, in sort order */
+  owner = xmalloc(0x110000 * sizeof(*owner));
+  memset(owner, 0xff, 0x110000 * sizeof(*owner));
+  for (i = 0; i < MIN(f->set->nfont, SHRT_MAX); i++) {
+    if (FcPatternGetCharSet(f->set->fonts[i], FC_CHARSET, 0, &charset) !=
+        FcResultMatch)
+      continue;
+    for (base = FcCharSetFirstPage(charset, map, &next);
+         base != FC_CHARSET_DONE && base < 0x110000;
+         base = FcCharSetNextPage(charset, map, &next)) {
+      for (j = 0; j < FC_CHARSET_MAP_SIZE; j++) {
+        for (k = 0; map[j] && k < 32; k++) {
+          u = base + j * 32 + k;
+          if (map[j] & (1U << k) && owner[u] < 0)
+            owner[u] = i;
+        }
+      }
+    }
+  }
+
+  for (u = 0, n = 0, cap = 0; u < 0x110000; u++) {
+    if (owner[u] < 0)
+      continue;
+    if (n == cap) {
+      cap = MAX(2 * cap, 256);
+      f->cover = xrealloc(f->cover, cap * sizeof(*f->cover));
+    }
+    f->cover[n].first = u;
+    f->cover[n].font = owner[u];
+    while (u + 1 < 0x110000 && owner[u + 1] == owner[u])
+      u++;
+    f->cover[n++].last = u;
+  }
+  f->len = n;
+  free(owner);
+
+  if (path[0])
+    coversave(f, path);
+}
+
+/*
+ * The path of the named cache file with the given key, in the cache
+ * directory, which is created with its parents if necessary.
+ */
+int cachepath(char *path, size_t size, const char *name, uint32_t key) {
+  char *dir;
+  int n;
+
+  if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+    n = snprintf(path, size, "%s/wterm", dir);
+  else if ((dir = getenv("HOME")))
+    n = snprintf(path, size, "%s/.cache/wterm", dir);
+  else
+    return -1;
+  if (n < 0 || n >= size || mkdirs(path, 0755) < 0)
+    return -1;
+  n = snprintf(path + n, size - n, "/%s-%08x", name, key) + n;
+  return n < size ? 0 : -1;
+}
+
+/* Like mkdir -p. */
+int mkdirs(char *path, mode_t mode) {
+  char *p;
+  int last, ret = 0;
+
+  for (p = path + 1; ret == 0; p++) {
+    if (*p != '/' && *p != '\0')
+      continue;
+    last = *p == '\0';
+    *p = '\0';
+    if (mkdir(path, mode) < 0 && errno != EEXIST)
+      ret = -1;
+    if (last)
+      break;
+    *p = '/';
+  }
+  return ret;
+}
+
+/* FNV-1a */
+uint32_t strhash(uint32_t key, const char *s) {
+  for (; *s; s++)
+    key = (key ^ (uchar)*s) * 16777619;
+  return key;
+}
+
+void coverfree(Coverset *f) {
+  if (f->set)
+    FcFontSetDestroy(f->set);
+  free(f->cover);
+}
+
+int coverfind(Coverset *f, Rune u) {
+  int lo = 0, hi = f->len - 1, mid;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (u < f->cover[mid].first)
+      hi = mid - 1;
+    else if (u > f->cover[mid].last)
+      lo = mid + 1;
+    else
+      return f->cover[mid].font;
+  }
+  return -1;
+}
+
+int coverload(Coverset *f, const char *path) {
+  struct stat st;
+  Coverage *cover;
+  int fd, n, i;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size % sizeof(*cover) != 0 ||
+      st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  n = st.st_size / sizeof(*cover);
+  cover = xmalloc(st.st_size);
+  if (read(fd, cover, st.st_size) != st.st_size) {
+    free(cover);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  for (i = 0; i < n; i++) {
+    if (cover[i].font < 0 || cover[i].font >= f->set->nfont) {
+      free(cover);
+      return -1;
+    }
+  }
+  f->cover = cover;
+  f->len = n;
+  return 0;
+}
+
+void coversave(Coverset *f, const char *path) {
+  char tmp[PATH_MAX];
+  ssize_t len = f->len * sizeof(*f->cover);
+  int fd;
+
+  if (len == 0)
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return;
+  if (write(fd, f->cover, len) != len) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  close(fd);
+  if (rename(tmp, path) < 0)
+    unlink(tmp);
+}
+
+void wlresolvestyle(Glyph base, Style *style) {
+  uint32_t fg, bg, temp;
+
+  style->font = &dc.font;
+  style->frcflags = FRC_NORMAL;
+
+  if (base.mode & ATTR_ITALIC) {
+    style->font = &dc.ifont;
+    style->frcflags = FRC_ITALIC;
+  }
+
+  if (base.mode & ATTR_BOLD) {
+    if (base.mode & ATTR_ITALIC) {
+      style->font = &dc.ibfont;
+      style->frcflags = FRC_ITALICBOLD;
+    } else {
+      style->font = &dc.bfont;
+      style->frcflags = FRC_BOLD;
+    }
+  }
+
+  if (base.mode & ATTR_ITALIC) {
+    if (base.fg == defaultfg)
+      base.fg = defaultitalic;
+  } else if (base.mode & ATTR_UNDERLINE) {
+    if (base.fg == defaultfg)
+      base.fg = defaultunderline;
+  }
+
+  if (IS_TRUECOL(base.fg)) {
+    fg = base.fg;
+  } else {
+    fg = dc.col[base.fg];
+  }
+
+  if (IS_TRUECOL(base.bg)) {
+    bg = base.bg | 0xff000000;
+  } else {
+    bg = dc.col[base.bg];
+  }
+
+  /*
+   * change basic system colors [0-7]
+   * to bright system colors [8-15]
+   */
+  if (base.mode & ATTR_BOLD && BETWEEN(base.fg, 0, 7) &&
+      !(base.mode & ATTR_FAINT))
+    fg = dc.col[base.fg + 8];
+
+  if (IS_SET(MODE_REVERSE)) {
     if (fg == dc.col[defaultfg]) {
       fg = dc.col[defaultbg];
     } else {
@@ -3102,53 +4598,111 @@ void wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
   if (base.mode & ATTR_INVISIBLE)
     fg = bg;
 
-  /* Intelligent cleaning up of the borders. */
-  if (x == 0) {
-    wlclear(0, (y == 0) ? 0 : winy, borderpx,
-            ((y >= term.row - 1) ? wl.h : (winy + wl.ch)));
-  }
-  if (x + charlen >= term.col) {
-    wlclear(winx + width, (y == 0) ? 0 : winy, wl.w,
-            ((y >= term.row - 1) ? wl.h : (winy + wl.ch)));
-  }
-  if (y == 0)
-    wlclear(winx, 0, winx + width, borderpx);
-  if (y == term.row - 1)
-    wlclear(winx, winy + wl.ch, winx + width, wl.h);
-
-  /* Clean up the region we want to draw to. */
-  wld_fill_rectangle(wld.renderer,
-                     (bg & (term_alpha << 24)) | (bg & 0x00FFFFFF), winx, winy,
-                     width, wl.ch);
-  for (xp = winx; bytelen > 0;) {
+  style->fg = fg;
+  style->bg = (bg & (term_alpha << 24)) | (bg & 0x00FFFFFF);
+}
+
+const Style *wlstyle(Glyph base) {
+  int reverse = IS_SET(MODE_REVERSE) != 0, blink = IS_SET(MODE_BLINK) != 0;
+  uint32_t i;
+
+  i = ((base.fg * 31 + base.bg) * 31 + base.mode) % LEN(stylecache);
+  if (!stylecache[i].valid || stylecache[i].mode != base.mode ||
+      stylecache[i].fg != base.fg || stylecache[i].bg != base.bg ||
+      stylecache[i].reverse != reverse || stylecache[i].blink != blink) {
+    wlresolvestyle(base, &stylecache[i].style);
+    stylecache[i].valid = true;
+    stylecache[i].mode = base.mode;
+    stylecache[i].fg = base.fg;
+    stylecache[i].bg = base.bg;
+    stylecache[i].reverse = reverse;
+    stylecache[i].blink = blink;
+  }
+  return &stylecache[i].style;
+}
+
+void stylereset(void) { memset(stylecache, 0, sizeof(stylecache)); }
+
+/*
+ * Queue a rectangle of background. Spans of the same color are merged into
+ * one region and filled together by bgflush().
+ */
+void bgspan(uint32_t color, int x, int y, int w, int h) {
+  int i;
+
+  if (w <= 0 || h <= 0)
+    return;
+
+  for (i = 0; i < bgspanslen && bgspans[i].color != color; i++)
+    ;
+  if (i == LEN(bgspans)) {
+    bgflush();
+    i = 0;
+  }
+  if (i == bgspanslen) {
+    bgspans[i].color = color;
+    pixman_region32_init(&bgspans[i].region);
+    bgspanslen++;
+  }
+  pixman_region32_union_rect(&bgspans[i].region, &bgspans[i].region, x, y, w,
+                             h);
+}
+
+void bgflush(void) {
+  int i;
+
+  for (i = 0; i < bgspanslen; i++) {
+    wld_fill_region(wld.renderer, bgspans[i].color, &bgspans[i].region);
+    pixman_region32_fini(&bgspans[i].region);
+  }
+  bgspanslen = 0;
+}
+
+/*
+ * Only draws the foreground; the background of the cells, including the
+ * borders, is filled beforehand by drawregion() or wldrawglyph().
+ */
+void wldraws(const Rune *s, Glyph base, int x, int y, int charlen, int len) {
+  int winx = borderpx + x * wl.cw - wld.ox;
+  int winy = borderpx + y * wl.ch - wld.oy;
+  int width = charlen * wl.cw, xp, i, w;
+  int n, doesexist, isbox;
+  const Rune *fs;
+  Rune unicodep;
+  Font *font;
+  struct wld_font *fallbackmatch;
+  const Style *style = wlstyle(base);
+  uint32_t fg = style->fg, bg = style->bg;
+  int oneatatime;
+
+  font = style->font;
+
+  for (xp = winx; len > 0;) {
     /*
      * Search for the range in the to be printed string of glyphs
      * that are in the main font. Then print that range. If
      * some glyph is found that is not in the font, do the
      * fallback dance.
      */
-    u8fs = s;
-    u8fblen = 0;
-    u8fl = 0;
+    fs = s;
+    n = 0;
     oneatatime = font->width != wl.cw;
     for (;;) {
-      u8c = s;
-      u8cblen = utf8decode(s, &unicodep, UTF_SIZ);
-      s += u8cblen;
-      bytelen -= u8cblen;
+      unicodep = *s++;
+      len--;
 
-      doesexist = wld_font_ensure_char(font->match, unicodep);
+      isbox = ISBOXDRAW(unicodep);
+      doesexist = !isbox && wld_font_ensure_char(font->match, unicodep);
       if (doesexist) {
-        u8fl++;
-        u8fblen += u8cblen;
-        if (!oneatatime && bytelen > 0)
+        n++;
+        if (!oneatatime && len > 0)
           continue;
       }
 
-      if (u8fl > 0) {
-        wld_draw_text(wld.renderer, font->match, fg, xp, winy + font->ascent,
-                      u8fs, u8fblen, NULL);
-        xp += wl.cw * u8fl;
+      if (n > 0) {
+        wld_draw_chars(wld.renderer, font->match, fg, xp, winy + font->ascent,
+                       fs, n, NULL);
+        xp += wl.cw * n;
       }
       break;
     }
@@ -3158,66 +4712,25 @@ void wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
       break;
     }
 
-    /* Search the font cache. */
-    for (i = 0; i < frclen; i++) {
-      charexists = wld_font_ensure_char(frc[i].font, unicodep);
-      /* Everything correct. */
-      if (charexists && frc[i].flags == frcflags)
-        break;
-      /* We got a default font for a not found glyph. */
-      if (!charexists && frc[i].flags == frcflags &&
-          frc[i].unicodep == unicodep) {
-        break;
-      }
+    if (isbox) {
+      wldrawbox(unicodep, xp, winy, fg, bg);
+      xp += wl.cw;
+      continue;
     }
 
-    /* Nothing was found. */
-    if (i >= frclen) {
-      if (!font->set)
-        font->set = FcFontSort(0, font->pattern, 1, 0, &fcres);
-      fcsets[0] = font->set;
-
-      /*
-       * Nothing was found in the cache. Now use
-       * some dozen of Fontconfig calls to get the
-       * font for one single character.
-       *
-       * Xft and fontconfig are design failures.
-       */
-      fcpattern = FcPatternDuplicate(font->pattern);
-      fccharset = FcCharSetCreate();
-
-      FcCharSetAddChar(fccharset, unicodep);
-      FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-      FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-      FcConfigSubstitute(0, fcpattern, FcMatchPattern);
-      FcDefaultSubstitute(fcpattern);
-
-      fontpattern = FcFontSetMatch(0, fcsets, 1, fcpattern, &fcres);
-
-      /*
-       * Overwrite or create the new cache entry.
-       */
-      if (frclen >= LEN(frc)) {
-        frclen = LEN(frc) - 1;
-        wld_font_close(frc[frclen].font);
-        frc[frclen].unicodep = 0;
-      }
-
-      frc[frclen].font = wld_font_open_pattern(wld.fontctx, fontpattern);
-      frc[frclen].flags = frcflags;
-      frc[frclen].unicodep = unicodep;
-
-      i = frclen;
-      frclen++;
-
-      FcPatternDestroy(fcpattern);
-      FcCharSetDestroy(fccharset);
+    /* Characters no font has are left blank, as wld draws no glyph 0. */
+    i = fallbackfont(font, unicodep, style->frcflags);
+    if (i == FALLBACK_PENDING) {
+      w = wl.cw * MAX(1, wcwidth(unicodep));
+      wldrawpending(xp, winy, w, fg);
+      if (BETWEEN(y, 0, term.row - 1))
+        wld.pending[y] = 1;
+      xp += w;
+      continue;
     }
-
-    wld_draw_text(wld.renderer, frc[i].font, fg, xp, winy + frc[i].font->ascent,
-                  u8c, u8cblen, NULL);
+    fallbackmatch = (i < 0) ? font->match : frc[i].font;
+    wld_draw_chars(wld.renderer, fallbackmatch, fg, xp,
+                   winy + fallbackmatch->ascent, &unicodep, 1, NULL);
 
     xp += wl.cw * wcwidth(unicodep);
   }
@@ -3233,82 +4746,218 @@ void wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
   }
 }
 
+/* A placeholder for a character until the worker has found its font */
+void wldrawpending(int x, int y, int w, uint32_t fg) {
+  wld_fill_rectangle(wld.renderer, fg, x + 1, y + 1, w - 2, 1);
+  wld_fill_rectangle(wld.renderer, fg, x + 1, y + wl.ch - 2, w - 2, 1);
+  wld_fill_rectangle(wld.renderer, fg, x + 1, y + 1, 1, wl.ch - 2);
+  wld_fill_rectangle(wld.renderer, fg, x + w - 2, y + 1, 1, wl.ch - 2);
+}
+
+/*
+ * Draw the glyphs and lines of the cells x1 to x2 of a row with one call into
+ * wld, over the backgrounds already drawn. Box-drawing characters and
+ * placeholders are drawn here directly.
+ */
+void wldrawrow(int y, int x1, int x2, int ena_sel) {
+  struct wld_font *fonts[4 + LEN(frc)];
+  struct wld_font *f;
+  struct wld_cell_layout layout;
+  struct wld_cell *c;
+  const Style *style;
+  Glyph g;
+  int x, xp, i, start = x1, lined = 0, winy = borderpx + y * wl.ch - wld.oy;
+
+  layout.width = wl.cw;
+  layout.height = wl.ch;
+  layout.fonts = fonts;
+  layout.num_fonts = 0;
+  layout.underline = dc.font.ascent + 1;
+  layout.strike = 2 * dc.font.ascent / 3;
+
+  for (x = x1; x < x2; x++) {
+    c = &wld.cells[x - x1];
+    g = term.line[y][x];
+    if (g.mode == ATTR_WDUMMY) {
+      /* the second half of a wide character shares its lines */
+      if (x > x1)
+        *c = c[-1];
+      else
+        memset(c, 0, sizeof(*c));
+      c->character = 0;
+      c->flags |= WLD_CELL_NO_BACKGROUND;
+      continue;
+    }
+    if (ena_sel && selected(x, y))
+      g.mode ^= ATTR_REVERSE;
+    style = wlstyle(g);
+
+    /* the lines are placed from the font of their style, one per batch */
+    if (g.mode & (ATTR_UNDERLINE | ATTR_STRUCK)) {
+      if (lined && layout.underline != style->font->ascent + 1) {
+        wldrawcells(x1, start, x, winy, &layout);
+        start = x;
+        lined = 0;
+      }
+      if (!lined) {
+        layout.underline = style->font->ascent + 1;
+        layout.strike = 2 * style->font->ascent / 3;
+        lined = 1;
+      }
+    }
+
+    c->character = 0;
+    c->fg = style->fg;
+    c->bg = style->bg;
+    c->font = 0;
+    c->flags = WLD_CELL_NO_BACKGROUND;
+    if (g.mode & ATTR_UNDERLINE)
+      c->flags |= WLD_CELL_UNDERLINE;
+    if (g.mode & ATTR_STRUCK)
+      c->flags |= WLD_CELL_STRUCK;
+    if (g.u == ' ' || g.u == 0)
+      continue;
+
+    xp = borderpx + x * wl.cw - wld.ox;
+    if (ISBOXDRAW(g.u)) {
+      wldrawbox(g.u, xp, winy, style->fg, style->bg);
+      continue;
+    }
+    f = style->font->match;
+    if (!wld_font_ensure_char(f, g.u)) {
+      /* Characters no font has are left blank, as wld draws no glyph 0. */
+      i = fallbackfont(style->font, g.u, style->frcflags);
+      if (i == FALLBACK_PENDING) {
+        wldrawpending(xp, winy, wl.cw * MAX(1, wcwidth(g.u)), style->fg);
+        wld.pending[y] = 1;
+        continue;
+      }
+      if (i >= 0)
+        f = frc[i].font;
+    }
+
+    for (i = 0; i < layout.num_fonts && fonts[i] != f; i++)
+      ;
+    if (i == layout.num_fonts) {
+      /* out of fonts, so draw what there is and start again */
+      if (i == LEN(fonts)) {
+        wldrawcells(x1, start, x, winy, &layout);
+        start = x;
+        lined = (g.mode & (ATTR_UNDERLINE | ATTR_STRUCK)) != 0;
+        i = 0;
+      }
+      fonts[layout.num_fonts++] = f;
+    }
+    c->character = g.u;
+    c->font = i;
+  }
+
+  wldrawcells(x1, start, x2, winy, &layout);
+}
+
+/*
+ * Draw the cells of wld.cells for the columns from start to end of a row
+ * whose cells begin at column x1, and empty the fonts of the layout.
+ */
+void wldrawcells(int x1, int start, int end, int winy,
+                 struct wld_cell_layout *layout) {
+  if (end > start)
+    wld_draw_cells(wld.renderer, borderpx + start * wl.cw - wld.ox, winy,
+                   &wld.cells[start - x1], end - start, layout);
+  layout->num_fonts = 0;
+}
+
 void wldrawglyph(Glyph g, int x, int y) {
-  static char buf[UTF_SIZ];
-  size_t len = utf8encode(g.u, buf);
   int width = g.mode & ATTR_WIDE ? 2 : 1;
 
-  wldraws(buf, g, x, y, width, len);
+  wld_fill_rectangle(wld.renderer, wlstyle(g)->bg,
+                     borderpx + x * wl.cw - wld.ox,
+                     borderpx + y * wl.ch - wld.oy, width * wl.cw, wl.ch);
+  wldraws(&g.u, g, x, y, width, 1);
 }
 
-void wldrawcursor(void) {
-  static int oldx = 0, oldy = 0;
-  int curx;
+/*
+ * The cursor is drawn into its own small buffer on a subsurface, so moving it
+ * only repositions the subsurface and never touches the main buffer. The
+ * buffer is two cells wide to fit a wide character; the part not covered by
+ * the cursor is transparent. Changes are applied with the next commit of the
+ * main surface. dirty tells whether the row under the cursor was redrawn.
+ */
+void wldrawcursor(int dirty) {
+  static int oldx = -1, oldy = -1, oldstate = -1, oldstyle = -1;
+  static Glyph oldg;
+  int curx, state, x, y;
   Glyph g = {' ', ATTR_NULL, defaultbg, defaultcs};
-
-  LIMIT(oldx, 0, term.col - 1);
-  LIMIT(oldy, 0, term.row - 1);
+  uint32_t cs;
 
   curx = term.c.x;
 
   /* adjust position if in dummy */
-  if (term.line[oldy][oldx].mode & ATTR_WDUMMY)
-    oldx--;
   if (term.line[term.c.y][curx].mode & ATTR_WDUMMY)
     curx--;
 
-  g.u = term.line[term.c.y][term.c.x].u;
+  x = borderpx + curx * wl.cw, y = borderpx + term.c.y * wl.ch;
+  if (x != oldx || y != oldy) {
+    wl_subsurface_set_position(wl.cursubsurf, x, y);
+    oldx = x, oldy = y;
+  }
 
-  /* remove the old cursor */
-  wldrawglyph(term.line[oldy][oldx], oldx, oldy);
-  if (oldx != curx || oldy != term.c.y) {
-    wl_surface_damage(wl.surface, borderpx + oldx * wl.cw,
-                      borderpx + oldy * wl.ch, wl.cw, wl.ch);
+  g.u = term.line[term.c.y][term.c.x].u;
+  g.mode |= term.line[term.c.y][curx].mode & ATTR_WIDE;
+  if (IS_SET(MODE_REVERSE)) {
+    g.mode |= ATTR_REVERSE;
+    g.fg = defaultcs;
+    g.bg = defaultfg;
   }
 
-  if (IS_SET(MODE_HIDE))
+  state = IS_SET(MODE_HIDE) ? 0 : (wl.state & WIN_FOCUSED) ? 1 : 2;
+  /* only the block cursor shows the glyph underneath */
+  if (!dirty && wld.oldcurbuffer == NULL && state == oldstate &&
+      wl.cursor == oldstyle &&
+      (state != 1 || wl.cursor > 2 ||
+       (g.u == oldg.u && g.mode == oldg.mode)))
+    return;
+  oldstate = state, oldstyle = wl.cursor, oldg = g;
+
+  if (state == 0) {
+    wl_surface_attach(wl.cursurface, NULL, 0, 0);
+    wl_surface_commit(wl.cursurface);
     return;
-  uint32_t cs = dc.col[defaultcs] & (term_alpha << 24);
-  /* draw the new one */
-  if (wl.state & WIN_FOCUSED) {
+  }
+
+  cs = dc.col[defaultcs] & (term_alpha << 24);
+  wld_set_target_buffer(wld.renderer, wld.curbuffer);
+  wld_fill_rectangle(wld.renderer, 0, 0, 0, 2 * wl.cw, wl.ch);
+  if (state == 1) {
     switch (wl.cursor) {
     case 0: /* Blinking Block */
     case 1: /* Blinking Block (Default) */
     case 2: /* Steady Block */
-      if (IS_SET(MODE_REVERSE)) {
-        g.mode |= ATTR_REVERSE;
-        g.fg = defaultcs;
-        g.bg = defaultfg;
-      }
-
-      g.mode |= term.line[term.c.y][curx].mode & ATTR_WIDE;
-      wldrawglyph(g, term.c.x, term.c.y);
+      wld.ox = x, wld.oy = y;
+      wldrawglyph(g, curx, term.c.y);
+      wld.ox = wld.oy = 0;
       break;
     case 3: /* Blinking Underline */
     case 4: /* Steady Underline */
-      wld_fill_rectangle(wld.renderer, cs, borderpx + curx * wl.cw,
-                         borderpx + (term.c.y + 1) * wl.ch - cursorthickness,
-                         wl.cw, cursorthickness);
+      wld_fill_rectangle(wld.renderer, cs, 0, wl.ch - cursorthickness, wl.cw,
+                         cursorthickness);
       break;
     case 5: /* Blinking bar */
     case 6: /* Steady bar */
-      wld_fill_rectangle(wld.renderer, cs, borderpx + curx * wl.cw,
-                         borderpx + term.c.y * wl.ch, cursorthickness, wl.ch);
+      wld_fill_rectangle(wld.renderer, cs, 0, 0, cursorthickness, wl.ch);
       break;
     }
   } else {
-    wld_fill_rectangle(wld.renderer, cs, borderpx + curx * wl.cw,
-                       borderpx + term.c.y * wl.ch, wl.cw - 1, 1);
-    wld_fill_rectangle(wld.renderer, cs, borderpx + curx * wl.cw,
-                       borderpx + term.c.y * wl.ch, 1, wl.ch - 1);
-    wld_fill_rectangle(wld.renderer, cs, borderpx + (curx + 1) * wl.cw - 1,
-                       borderpx + term.c.y * wl.ch, 1, wl.ch - 1);
-    wld_fill_rectangle(wld.renderer, cs, borderpx + curx * wl.cw,
-                       borderpx + (term.c.y + 1) * wl.ch - 1, wl.cw, 1);
+    wld_fill_rectangle(wld.renderer, cs, 0, 0, wl.cw - 1, 1);
+    wld_fill_rectangle(wld.renderer, cs, 0, 0, 1, wl.ch - 1);
+    wld_fill_rectangle(wld.renderer, cs, wl.cw - 1, 0, 1, wl.ch - 1);
+    wld_fill_rectangle(wld.renderer, cs, 0, wl.ch - 1, wl.cw, 1);
   }
-  wl_surface_damage(wl.surface, borderpx + curx * wl.cw,
-                    borderpx + term.c.y * wl.ch, wl.cw, wl.ch);
-  oldx = curx, oldy = term.c.y;
+  wld_flush(wld.renderer);
+
+  wl_surface_attach(wl.cursurface, wl.curbuffer, 0, 0);
+  wlsubmitdamage(wl.cursurface, wld.curbuffer);
+  wl_surface_commit(wl.cursurface);
 }
 
 void wlsettitle(char *title) {
@@ -3322,70 +4971,215 @@ void wlresettitle(void) { wlsettitle(opt_title ? opt_title : "wterm"); }
 
 void redraw(void) { tfulldirt(); }
 
+/*
+ * Whether the pixels of a row would change if it was drawn again, from
+ * everything that decides them: the glyphs, their attributes with the
+ * selection applied and the resolved colors. The cursor is not part of the
+ * main buffer, so it is left out. A hash of the row rules out most changes
+ * and the cells it was last drawn with settle the rest, so that a collision
+ * cannot leave the row stale. A changed row is recorded as drawn.
+ */
+int rowchanged(int y, int ena_sel) {
+  uint32_t h = 2166136261u;
+  const Style *style;
+  DrawnCell *c = wld.rowbuf, *drawn = &wld.drawn[y * term.col];
+  Glyph base, new;
+  int x;
+
+  for (x = 0; x < term.col; x++, c++) {
+    new = term.line[y][x];
+    if (ena_sel && selected(x, y))
+      new.mode ^= ATTR_REVERSE;
+    if (x == 0 || ATTRCMP(base, new)) {
+      style = wlstyle(new);
+      base = new;
+    }
+    c->u = new.u;
+    c->mode = new.mode;
+    c->fg = style->fg;
+    c->bg = style->bg;
+    h = (h ^ c->u) * 16777619;
+    h = (h ^ c->mode) * 16777619;
+    h = (h ^ c->fg) * 16777619;
+    h = (h ^ c->bg) * 16777619;
+  }
+  h = h ? h : 1;
+  if (h == wld.rowhash[y] &&
+      memcmp(wld.rowbuf, drawn, term.col * sizeof(*drawn)) == 0)
+    return 0;
+  wld.rowhash[y] = h;
+  memcpy(drawn, wld.rowbuf, term.col * sizeof(*drawn));
+  return 1;
+}
+
+/*
+ * The rows from top to bot moved down by n rows, or up if n is negative. The
+ * buffer is scrolled the same way on the next draw, so the rows that only
+ * moved are not drawn again. Scrolls of another region in between are not
+ * combined; the rows of the earlier one are drawn again instead.
+ */
+void wlscroll(int top, int bot, int n) {
+  if (wld.scrolln && (top != wld.scrolltop || bot != wld.scrollbot)) {
+    wlforgetrows(wld.scrolltop, wld.scrollbot);
+    wld.scrolln = 0;
+  }
+  wld.scrolltop = top;
+  wld.scrollbot = bot;
+  wld.scrolln += n;
+  LIMIT(wld.scrolln, top - bot - 1, bot - top + 1);
+}
+
+/* Do the pending scroll on the buffer and the rows known to be in it. */
+void wlscrollbuffer(void) {
+  int top = wld.scrolltop, bot = wld.scrollbot, n = wld.scrolln;
+  int rows = bot - top + 1 - abs(n), from = n < 0 ? top - n : top;
+
+  wld.scrolln = 0;
+  if (rows > 0) {
+    wld_scroll_rectangle(wld.renderer, borderpx, borderpx + top * wl.ch,
+                         term.col * wl.cw, (bot - top + 1) * wl.ch, n * wl.ch);
+    memmove(&wld.rowhash[from + n], &wld.rowhash[from],
+            rows * sizeof(*wld.rowhash));
+    memmove(&wld.drawn[(from + n) * term.col], &wld.drawn[from * term.col],
+            rows * term.col * sizeof(*wld.drawn));
+    memmove(&wld.pending[from + n], &wld.pending[from],
+            rows * sizeof(*wld.pending));
+  }
+  /* the rows uncovered are left as they were */
+  if (n < 0)
+    wlforgetrows(bot + n + 1, bot);
+  else
+    wlforgetrows(top, top + n - 1);
+}
+
+/* Draw the rows from y1 to y2 again, whatever they hold. */
+void wlforgetrows(int y1, int y2) {
+  for (; y1 <= y2; y1++)
+    wld.rowhash[y1] = 0;
+}
+
+void dumpstats(void) {
+  static const char *names[] = {"regular", "italic", "bold italic", "bold"};
+  struct wld_font_stats fs;
+  int i;
+
+  fprintf(stderr, "rows drawn: %lu, skipped: %lu\n", stats.rowsdrawn,
+          stats.rowsskipped);
+  fprintf(stderr,
+          "fallback hits: %lu, misses: %lu, no font: %lu, pending: %lu\n",
+          stats.fallbackhits, stats.fallbackmisses, stats.fallbacknone,
+          stats.fallbackpending);
+  for (i = 0; i < LEN(cachedfonts); i++) {
+    wld_font_get_stats(cachedfonts[i]->match, &fs);
+    fprintf(stderr,
+            "%s glyphs: %u, hits: %u, misses: %u, memory: %zu, mapped: %zu\n",
+            names[i], fs.glyphs, fs.hits, fs.misses, fs.memory, fs.mapped);
+  }
+}
+
 void draw(void) {
-  int y, y0;
+  static struct wl_buffer *attached;
+  int y, damaged, curdirty = term.dirty[term.c.y];
+  int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+
+  if (resizes.pending)
+    resizeframe();
 
-  for (y = 0; y <= term.bot; ++y) {
+  wld_set_target_buffer(wld.renderer, wld.buffer);
+  if (wld.scrolln)
+    wlscrollbuffer();
+
+  /* rows marked dirty whose pixels would not change are left alone */
+  for (y = 0; y < term.row; ++y) {
     if (!term.dirty[y])
       continue;
-    for (y0 = y; y <= term.bot && term.dirty[y]; ++y)
-      ;
-    wl_surface_damage(wl.surface, 0, borderpx + y0 * wl.ch, wl.w,
-                      (y - y0) * wl.ch);
+    if (!rowchanged(y, ena_sel)) {
+      term.dirty[y] = 0;
+      stats.rowsskipped++;
+    } else {
+      stats.rowsdrawn++;
+    }
   }
 
-  wld_set_target_buffer(wld.renderer, wld.buffer);
   drawregion(0, 0, term.col, term.row);
+  wld_flush(wld.renderer);
+  damaged = wlsubmitdamage(wl.surface, wld.buffer);
+  /* a cursor-only change just commits the subsurface state */
+  if (damaged || wl.buffer != attached) {
+    wl_surface_attach(wl.surface, wl.buffer, 0, 0);
+    attached = wl.buffer;
+  }
+  wldrawcursor(curdirty);
+  if (wld.listfile)
+    wldumpframe();
   wl.framecb = wl_surface_frame(wl.surface);
   wl_callback_add_listener(wl.framecb, &framelistener, NULL);
-  wld_flush(wld.renderer);
-  wl_surface_attach(wl.surface, wl.buffer, 0, 0);
   wl_surface_commit(wl.surface);
-  /* need to wait to destroy the old buffer until we commit the new
-   * buffer */
+  /* need to wait to destroy the old buffers until we commit the new
+   * buffers */
   if (wld.oldbuffer) {
     wld_buffer_unreference(wld.oldbuffer);
     wld.oldbuffer = 0;
   }
+  if (wld.oldcurbuffer) {
+    wld_buffer_unreference(wld.oldcurbuffer);
+    wld.oldcurbuffer = 0;
+  }
   needdraw = false;
 }
 
 void drawregion(int x1, int y1, int x2, int y2) {
-  int ic, ib, x, y, ox;
+  int x, y, ox, winy, top, bot;
   Glyph base, new;
-  char buf[DRAW_BUF_SIZ];
+  uint32_t bg = 0;
   int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
 
+  /*
+   * First pass: the backgrounds of the dirty rows, merged into spans of the
+   * same color and filled with one region per color.
+   */
   for (y = y1; y < y2; y++) {
     if (!term.dirty[y])
       continue;
 
-    wltermclear(0, y, term.col, y);
-    term.dirty[y] = 0;
-    base = term.line[y][0];
-    ic = ib = ox = 0;
+    winy = borderpx + y * wl.ch;
+    top = (y == 0) ? 0 : winy;
+    bot = (y >= term.row - 1) ? wl.h : winy + wl.ch;
+    wlclear(0, top, borderpx, bot);
+    wlclear(borderpx + term.col * wl.cw, top, wl.w, bot);
+    if (y == 0)
+      wlclear(borderpx, 0, borderpx + term.col * wl.cw, borderpx);
+    if (y == term.row - 1)
+      wlclear(borderpx, winy + wl.ch, borderpx + term.col * wl.cw, wl.h);
+
+    ox = x1;
     for (x = x1; x < x2; x++) {
       new = term.line[y][x];
       if (new.mode == ATTR_WDUMMY)
         continue;
       if (ena_sel && selected(x, y))
         new.mode ^= ATTR_REVERSE;
-      if (ib > 0 && (ATTRCMP(base, new) || ib >= DRAW_BUF_SIZ - UTF_SIZ)) {
-        wldraws(buf, base, ox, y, ic, ib);
-        ic = ib = 0;
-      }
-      if (ib == 0) {
-        ox = x;
-        base = new;
-      }
-
-      ib += utf8encode(new.u, buf + ib);
-      ic += (new.mode &ATTR_WIDE) ? 2 : 1;
+      if (x > ox && !ATTRCMP(base, new))
+        continue;
+      if (x > ox)
+        bgspan(bg, borderpx + ox * wl.cw, winy, (x - ox) * wl.cw, wl.ch);
+      bg = wlstyle(new)->bg;
+      base = new;
+      ox = x;
     }
-    if (ib > 0)
-      wldraws(buf, base, ox, y, ic, ib);
+    if (x > ox)
+      bgspan(bg, borderpx + ox * wl.cw, winy, (x - ox) * wl.cw, wl.ch);
+  }
+  bgflush();
+
+  /* Second pass: the glyphs and lines, a row at a time. */
+  for (y = y1; y < y2; y++) {
+    if (!term.dirty[y])
+      continue;
+
+    term.dirty[y] = 0;
+    wldrawrow(y, x1, x2, ena_sel);
   }
-  wldrawcursor();
 }
 
 void wlseturgency(int add) { /* XXX: no urgency equivalent yet in wayland */
@@ -3436,7 +5230,17 @@ char *kmap(xkb_keysym_t k, uint state) {
 }
 
 void cresize(int width, int height) {
-  int col, row;
+  wlsetsize(width, height);
+  resizes.tty = 0;
+  ttyresize();
+}
+
+/*
+ * Resize the window, the grid and the buffer, and return whether the grid
+ * changed size.
+ */
+int wlsetsize(int width, int height) {
+  int col, row, changed;
 
   if (width != 0)
     wl.w = width;
@@ -3445,10 +5249,26 @@ void cresize(int width, int height) {
 
   col = (wl.w - 2 * borderpx) / wl.cw;
   row = (wl.h - 2 * borderpx) / wl.ch;
+  changed = col != term.col || row != term.row;
 
   tresize(col, row);
   wlresize(col, row);
-  ttyresize();
+  return changed;
+}
+
+/*
+ * Apply the last of the configures since the previous frame. The tty is told
+ * once the size has settled for ttyresizedelay, see run, so that the programs
+ * in the terminal do not redraw for every step of an interactive resize.
+ */
+void resizeframe(void) {
+  resizes.pending = 0;
+  if (resizes.w == wl.w && resizes.h == wl.h)
+    return;
+  if (wlsetsize(resizes.w, resizes.h)) {
+    resizes.tty = 1;
+    clock_gettime(CLOCK_MONOTONIC, &resizes.last);
+  }
 }
 
 void regglobal(void *data, struct wl_registry *registry, uint32_t name,
@@ -3457,7 +5277,11 @@ void regglobal(void *data, struct wl_registry *registry, uint32_t name,
     printf("interface %s\n", interface);
 
   if (strcmp(interface, "wl_compositor") == 0) {
-    wl.cmp = wl_registry_bind(registry, name, &wl_compositor_interface, 3);
+    wl.cmp = wl_registry_bind(registry, name, &wl_compositor_interface,
+                              MIN(version, 4));
+  } else if (strcmp(interface, "wl_subcompositor") == 0) {
+    wl.subcmp =
+        wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
   } else if (strcmp(interface, "xdg_wm_base") == 0 || strcmp(interface, "zxdg_shell_v6") == 0) {
     // printf("init xdg_wm_base\n");
     wl.xdgshell =
@@ -3465,6 +5289,12 @@ void regglobal(void *data, struct wl_registry *registry, uint32_t name,
     xdg_wm_base_add_listener(wl.xdgshell, &base_listener, NULL);
   } else if (strcmp(interface, "wl_shm") == 0) {
     wl.shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    /* wld collects the formats as they come, with no roundtrip of its own */
+    if (!wld.shmctx)
+      wld.shmctx = wld_wayland_create_shm_context(wl.dpy, wl.shm);
+  } else if (strcmp(interface, "wl_drm") == 0) {
+    wl.drm = name;
+    wl.drmversion = version;
   } else if (strcmp(interface, "wl_seat") == 0) {
     wl.seat = wl_registry_bind(registry, name, &wl_seat_interface, 4);
   } else if (strcmp(interface, "wl_data_device_manager") == 0) {
@@ -3788,9 +5618,17 @@ void xdgtopconfigure(void *data, struct xdg_toplevel *top, int32_t w,
                      int32_t h, struct wl_array *states) {
   xdg_toplevel_set_app_id(top, opt_class ? opt_class : termname);
   wl.configured = true;
-  if (wl.w == w && wl.h == h)
+  /* before the first frame, the size is needed right away, see run */
+  if (!wl.buffer) {
+    cresize(w, h);
+    return;
+  }
+  if (w == 0 && h == 0)
     return;
-  cresize(w, h);
+  resizes.w = w ? w : wl.w;
+  resizes.h = h ? h : wl.h;
+  resizes.pending = 1;
+  needdraw = true;
 }
 
 static void close_shell_and_exit() {
@@ -3858,7 +5696,7 @@ void datasrccancelled(void *data, struct wl_data_source *source) {
 
 void run(void) {
   fd_set rfd;
-  int wlfd = wl_display_get_fd(wl.dpy), blinkset = 0;
+  int wlfd = wl_display_get_fd(wl.dpy), blinkset = 0, ready;
   struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
   ulong msecs;
 
@@ -3877,13 +5715,19 @@ void run(void) {
     FD_ZERO(&rfd);
     FD_SET(cmdfd, &rfd);
     FD_SET(wlfd, &rfd);
+    FD_SET(fbw.pipe[0], &rfd);
 
-    if (pselect(MAX(wlfd, cmdfd) + 1, &rfd, NULL, NULL, tv, NULL) < 0) {
+    if ((ready = pselect(MAX(MAX(wlfd, cmdfd), fbw.pipe[0]) + 1, &rfd, NULL,
+                         NULL, tv, NULL)) < 0) {
       if (errno == EINTR)
         continue;
       die("select failed: %s\n", strerror(errno));
     }
 
+    /* nothing to handle, so rasterize some glyphs ahead of time */
+    if (ready == 0 && prewarm.active)
+      prewarmstep();
+
     if (FD_ISSET(cmdfd, &rfd)) {
       ttyread();
       if (blinktimeout) {
@@ -3893,6 +5737,9 @@ void run(void) {
       }
     }
 
+    if (FD_ISSET(fbw.pipe[0], &rfd))
+      fallbackdone();
+
     if (FD_ISSET(wlfd, &rfd)) {
 
       if (wl_display_dispatch(wl.dpy) == -1)
@@ -3930,15 +5777,31 @@ void run(void) {
       }
     }
 
+    /* a frame drawn here may resize too, so look at the tty after it */
+    wl_display_dispatch_pending(wl.dpy);
+
+    if (resizes.tty) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (TIMEDIFF(now, resizes.last) >= ttyresizedelay) {
+        resizes.tty = 0;
+        ttyresize();
+      } else {
+        msecs = MIN(msecs, ttyresizedelay - TIMEDIFF(now, resizes.last));
+      }
+    }
+
+    /* poll while there are glyphs to rasterize */
+    if (prewarm.active)
+      msecs = 0;
+
     if (msecs == -1) {
       tv = NULL;
     } else {
-      drawtimeout.tv_nsec = 1E6 * msecs;
-      drawtimeout.tv_sec = 0;
+      drawtimeout.tv_sec = msecs / 1000;
+      drawtimeout.tv_nsec = 1E6 * (msecs % 1000);
       tv = &drawtimeout;
     }
 
-    wl_display_dispatch_pending(wl.dpy);
     wl_display_flush(wl.dpy);
   }
 }